@@ -0,0 +1,461 @@
+#include <algorithm>
+#include <initializer_list>
+#include <utility>
+#include <vector>
+
+#include "dataflow.h"
+#include "icode.h"
+#include "output.h"
+
+/*
+ * Aggressive dead code elimination, after Cytron, Ferrante, Rosen,
+ * Wegman and Zadeck, "Efficiently Computing Static Single Assignment
+ * Form and the Control Dependence Graph".  Everything is dead until
+ * shown useful: the instructions with an effect besides their result
+ * are, and so are the definitions they read and the branches deciding
+ * whether they run at all, the blocks they are control dependent on.
+ * Definitions are found by the SSA names, or by reaching definitions
+ * outside SSA.  A live phi also needs the branches deciding which edge
+ * it came in by.
+ *
+ * Control dependence comes from the postdominator tree, over a virtual
+ * exit that the blocks without successors go to.  A branch that may
+ * never get to the exit, or may lead where it never does, stays: the
+ * loop it decides is not known to end.
+ *
+ * A dead conditional branch goes straight to its nearest postdominator
+ * holding live code, falling through if that is next.  The blocks in
+ * between have nothing live left and drop out of reach, their code and
+ * out edges go as in SCCP.  Should that postdominator have a live phi
+ * the branch stays, the new edge would have no operand.
+ */
+
+namespace {
+
+class Adce {
+public:
+	Adce (Function *f, bool ssa);
+	void run ();
+	int removed = 0, branches = 0, unreachable = 0;
+
+private:
+	Function *f;
+	bool ssa;
+	int nb, ni;
+	std::vector<int> ipdom;			// By block id, nb for the exit, -1 if it never gets there
+	std::vector<std::vector<int> > cd;	// By block id, the blocks whose branch decides it runs
+	std::vector<int> block_of;		// By instruction id
+	std::vector<char> live;			// By instruction id, in SSA by value
+	std::vector<char> decided;		// By block id, its cd marked
+	std::vector<int> work;
+
+	// Outside SSA the definitions reaching operand o of in are
+	// ud_list[ud_begin[2 * in->id + o]..ud_end[2 * in->id + o])
+	std::vector<int> ud_begin, ud_end, ud_list;
+	// In SSA what defines each value, by the id it is marked under:
+	// an instruction's own, or the phi's value; -1 for version 0
+	std::vector<int> def;
+	std::vector<Phi*> phi_of;
+
+	void postdominators ();
+	void control_dependence ();
+	void chains ();
+	void mark (int id);
+	void operand (Instruction *in, int o);
+	void decide (Block *b);
+	void propagate ();
+	bool conditional (Block *b) const;
+	bool live_phi (Block *b) const;
+	int target (Block *b, const std::vector<char> &useful) const;
+	void drop (Block *b, Block *gone);
+};
+
+Adce::Adce (Function *f, bool ssa): f(f), ssa(ssa), nb(f->blocks.size()), ni(f->instrs.size()),
+	cd(nb), block_of(ni, -1), decided(nb, 0)
+{
+	for (Block *b: f->blocks)
+		for (Instruction *in: b->instr)
+			block_of[in->id] = b->id;
+}
+
+bool Adce::conditional (Block *b) const
+{
+	Instruction *br = b->instr.back();
+	return br->op == Opcode::BLBC || br->op == Opcode::BLBS;
+}
+
+/* Cooper, Harvey and Kennedy as in compute_idoms(), over the reverse CFG */
+void Adce::postdominators ()
+{
+	std::vector<char> reached(nb, 0);
+	std::vector<int> exits;
+	for (int b: f->rpo) {
+		reached[b] = 1;
+		if (f->succs(b).size() == 0)
+			exits.push_back(b);
+	}
+	auto rsuccs = [&](int x) {
+		return x == nb ? IdRange{exits.data(), exits.data() + exits.size()} : f->preds(x);
+	};
+
+	// Postorder of the reverse CFG from the exit
+	std::vector<int> order, rank(nb + 1, -1);
+	std::vector<char> seen(nb + 1, 0);
+	std::vector<std::pair<int, const int*> > stack;
+	seen[nb] = 1;
+	stack.push_back(std::make_pair(nb, rsuccs(nb).begin()));
+	while (!stack.empty()) {
+		int x = stack.back().first;
+		const int *&next = stack.back().second;
+		if (next != rsuccs(x).end()) {
+			int y = *next++;
+			if (reached[y] && !seen[y]) {
+				seen[y] = 1;
+				stack.push_back(std::make_pair(y, rsuccs(y).begin()));
+			}
+		} else {
+			order.push_back(x);
+			stack.pop_back();
+		}
+	}
+	std::reverse(order.begin(), order.end());
+	for (size_t i = 0; i < order.size(); ++i)
+		rank[order[i]] = i;
+
+	ipdom.assign(nb + 1, -1);
+	ipdom[nb] = nb;
+	auto intersect = [&](int a, int b) {
+		while (a != b) {
+			while (rank[a] > rank[b])
+				a = ipdom[a];
+			while (rank[b] > rank[a])
+				b = ipdom[b];
+		}
+		return a;
+	};
+	bool change;
+	do {
+		change = false;
+		for (size_t i = 1; i < order.size(); ++i) {
+			int b = order[i], d = -1;
+			if (f->succs(b).size() == 0)
+				d = nb;
+			for (int s: f->succs(b)) if (ipdom[s] != -1)
+				d = d == -1 ? s : intersect(s, d);
+			if (d != ipdom[b]) {
+				ipdom[b] = d;
+				change = true;
+			}
+		}
+	} while (change);
+}
+
+/*
+ * Each block on the postdominator tree path from a successor of a
+ * branch up to the branch's own postdominator depends on it.
+ */
+void Adce::control_dependence ()
+{
+	for (int y: f->rpo) {
+		if (f->succs(y).size() < 2)
+			continue;
+		for (int s: f->succs(y))
+			for (int r = s; r != ipdom[y] && r != -1 && r != nb; r = ipdom[r])
+				cd[r].push_back(y);
+	}
+}
+
+void Adce::chains ()
+{
+	if (ssa) {
+		int n = f->value_block.size();
+		def.assign(n, -1);
+		phi_of.assign(n, nullptr);
+		for (int v = 0; v < ni; ++v)
+			def[v] = v;
+		for (Block *b: f->blocks) {
+			for (Phi &phi: b->phi)
+				if (!phi.empty()) {
+					int v = f->ssa_value_base[phi.var->id] + phi.l;
+					def[v] = v;
+					phi_of[v] = &phi;
+				}
+			for (Instruction *in: b->instr)
+				if (in->is_move() && in->oper[1].is_local() && in->oper[1].ssa_idx >= 0)
+					def[f->value_of(in->oper[1])] = in->id;
+		}
+		live.assign(n, 0);
+		return;
+	}
+
+	ReachingDefs rd;
+	rd.init(f);
+	DataflowSolver<ReachingDefs> solver(f, rd);
+	solver.solve();
+	ud_begin.assign(2 * ni, 0);
+	ud_end.assign(2 * ni, 0);
+	for (Block *b: f->blocks) {
+		BitVector cur = solver.in[b->id];
+		for (Instruction *in: b->instr) {
+			for (int o = 0; o < 2; ++o) {
+				int k = 2 * in->id + o;
+				ud_begin[k] = ud_list.size();
+				if (in->isrightvalue(o) && in->oper[o].is_local())
+					cur.each(rd.of_var[in->oper[o].var->id], [&](size_t d) {
+						ud_list.push_back(rd.def[d]->id);
+					});
+				ud_end[k] = ud_list.size();
+			}
+			if (rd.def_bit[in->id] != -1) {
+				cur.subtract(rd.of_var[in->oper[1].var->id]);
+				cur.set(rd.def_bit[in->id]);
+			}
+		}
+	}
+	live.assign(ni, 0);
+}
+
+void Adce::mark (int id)
+{
+	if (id >= 0 && !live[id]) {
+		live[id] = 1;
+		work.push_back(id);
+	}
+}
+
+void Adce::operand (Instruction *in, int o)
+{
+	const Operand &x = in->oper[o];
+	if (ssa) {
+		int v = f->value_of(x);
+		if (v >= 0)
+			mark(def[v]);
+	} else if (x.type == Operand::REG)
+		mark(x.reg->id);
+	else if (x.is_local())
+		for (int k = ud_begin[2 * in->id + o]; k < ud_end[2 * in->id + o]; ++k)
+			mark(ud_list[k]);
+}
+
+void Adce::decide (Block *b)
+{
+	if (decided[b->id])
+		return;
+	decided[b->id] = 1;
+	for (int y: cd[b->id])
+		mark(f->blocks[y]->instr.back()->id);
+}
+
+void Adce::propagate ()
+{
+	while (!work.empty()) {
+		int v = work.back();
+		work.pop_back();
+		if (v < ni) {
+			Instruction *in = f->instrs[v];
+			for (int o = 0; o < 2; ++o)
+				if (in->isrightvalue(o))
+					operand(in, o);
+			decide(f->blocks[block_of[v]]);
+			continue;
+		}
+		Phi *phi = phi_of[v];
+		for (size_t o = 0; o < phi->r.size(); ++o) {
+			int r = f->value_of(phi->r[o]);
+			if (r >= 0)
+				mark(def[r]);
+			Block *p = phi->pre[o];
+			decide(p);
+			if (conditional(p))
+				mark(p->instr.back()->id);
+		}
+		decide(f->value_block[v]);
+	}
+}
+
+bool Adce::live_phi (Block *b) const
+{
+	for (const Phi &phi: b->phi)
+		if (!phi.empty() && live[f->ssa_value_base[phi.var->id] + phi.l])
+			return true;
+	return false;
+}
+
+/* The nearest postdominator of b with live code, nb if none */
+int Adce::target (Block *b, const std::vector<char> &useful) const
+{
+	int t = ipdom[b->id];
+	while (t != nb && !useful[t])
+		t = ipdom[t];
+	return t;
+}
+
+void Adce::drop (Block *b, Block *gone)
+{
+	gone->prevs.erase(std::find(gone->prevs.begin(), gone->prevs.end(), b));
+	if (ssa)
+		f->ssa_remove_edge(b, gone);
+}
+
+void Adce::run ()
+{
+	postdominators();
+	control_dependence();
+	chains();
+
+	for (Instruction *in: f->instrs) {
+		Opcode::Type op = in->op;
+		if (op != Opcode::NOP && op != Opcode::BR && op != Opcode::BLBC && op != Opcode::BLBS && !in->eliminable())
+			mark(in->id);
+	}
+	for (int b: f->rpo) {
+		if (!conditional(f->blocks[b]))
+			continue;
+		bool ends = ipdom[b] != -1;
+		for (int s: f->succs(b))
+			ends = ends && ipdom[s] != -1;
+		if (!ends)
+			mark(f->blocks[b]->instr.back()->id);
+	}
+
+	// A branch left without a target is needed after all
+	std::vector<char> useful(nb);
+	for (;;) {
+		propagate();
+		std::fill(useful.begin(), useful.end(), 0);
+		for (Instruction *in: f->instrs)
+			if (live[in->id])
+				useful[block_of[in->id]] = 1;
+		for (Block *b: f->blocks)
+			if (ssa && live_phi(b))
+				useful[b->id] = 1;
+		for (int b: f->rpo) {
+			Block *y = f->blocks[b];
+			if (!conditional(y) || live[y->instr.back()->id])
+				continue;
+			int t = target(y, useful);
+			if (t == nb || (ssa && live_phi(f->blocks[t])))
+				mark(y->instr.back()->id);
+		}
+		if (work.empty())
+			break;
+	}
+
+	bool edges = false;
+	for (int b: f->rpo) {
+		Block *y = f->blocks[b];
+		Instruction *br = y->instr.back();
+		if (!conditional(y) || live[br->id])
+			continue;
+		++branches;
+		edges = true;
+		Block *t = f->blocks[target(y, useful)];
+		if (t == y->seq_next) {
+			drop(y, y->br_next);
+			y->br_next = nullptr;
+			br->erase();
+			continue;
+		}
+		drop(y, y->seq_next);
+		y->seq_next = nullptr;
+		if (t != y->br_next) {
+			drop(y, y->br_next);
+			y->br_next = t;
+			t->prevs.push_back(y);
+		}
+		br->op.type = Opcode::BR;
+		br->oper[0] = br->oper[1];
+		br->oper[1] = Operand();
+		br->set_branch(t);
+	}
+	for (Block *b: f->blocks) {
+		for (Instruction *in: b->instr) {
+			Opcode::Type op = in->op;
+			if (op != Opcode::NOP && op != Opcode::BR && op != Opcode::BLBC && op != Opcode::BLBS && !live[in->id]) {
+				in->erase();
+				++removed;
+			}
+		}
+		if (ssa)
+			b->phi.erase(std::remove_if(b->phi.begin(), b->phi.end(), [&](const Phi &phi) {
+				return phi.empty() || !live[f->ssa_value_base[phi.var->id] + phi.l];
+			}), b->phi.end());
+	}
+	if (!edges)
+		return;
+
+	// What the rewritten branches skip, only the ret stays as in SCCP
+	std::vector<char> reached(nb, 0);
+	std::vector<Block*> stack(1, f->entry);
+	reached[f->entry->id] = 1;
+	while (!stack.empty()) {
+		Block *b = stack.back();
+		stack.pop_back();
+		for (Block *next: { b->seq_next, b->br_next })
+			if (next != nullptr && !reached[next->id]) {
+				reached[next->id] = 1;
+				stack.push_back(next);
+			}
+	}
+	for (int b: f->rpo) {
+		Block *y = f->blocks[b];
+		if (reached[b])
+			continue;
+		++unreachable;
+		for (Phi &phi: y->phi)
+			phi.clear();
+		for (Instruction *in: y->instr)
+			if (in->op != Opcode::RET)
+				in->erase();
+		for (Block **next: { &y->seq_next, &y->br_next })
+			if (*next != nullptr) {
+				drop(y, *next);
+				*next = nullptr;
+			}
+	}
+
+	f->index();
+	f->build_domtree();
+	if (ssa)
+		f->ssa_update();
+}
+
+}
+
+void Function::aggressive_dead_eliminate()
+{
+	index();
+	Adce adce(this, false);
+	adce.run();
+
+	if (prog->output_report) {
+		report(std_out, "Function: %d\n", name);
+		report(std_out, "Number of statements eliminated (ADCE): %d\n", adce.removed);
+		report(std_out, "Number of branches removed (ADCE): %d\n", adce.branches);
+		report(std_out, "Number of unreachable blocks: %d\n", adce.unreachable);
+	}
+}
+
+void Function::ssa_aggressive_dead_eliminate()
+{
+	ssa_index();
+	Adce adce(this, true);
+	adce.run();
+
+	if (prog->output_report) {
+		report(std_out, "Function: %d\n", name);
+		report(std_out, "Number of statements eliminated (ADCE): %d\n", adce.removed);
+		report(std_out, "Number of branches removed (ADCE): %d\n", adce.branches);
+		report(std_out, "Number of unreachable blocks: %d\n", adce.unreachable);
+	}
+}
+
+void Program::aggressive_dead_eliminate()
+{
+	each_function(&Function::aggressive_dead_eliminate);
+}
+
+void Program::ssa_aggressive_dead_eliminate()
+{
+	each_function(&Function::ssa_aggressive_dead_eliminate);
+}
@@ -0,0 +1,51 @@
+#include <cstdlib>
+#include <cstdio>
+
+#include "arena.h"
+
+std::atomic<size_t> Arena::total_allocations(0), Arena::total_bytes(0), Arena::total_chunks(0);
+
+Arena::Arena ():
+	allocations(0), bytes(0), cur(NULL), end(NULL), next_chunk(first_chunk)
+{
+}
+
+Arena::~Arena ()
+{
+	release();
+}
+
+void Arena::grow (size_t min)
+{
+	size_t n = next_chunk;
+	if (next_chunk < max_chunk)
+		next_chunk *= 2;
+	if (n < min)
+		n = min;
+
+	cur = (char *)malloc(n);
+	if (cur == NULL) {
+		perror("malloc");
+		abort();
+	}
+	end = cur + n;
+	chunks.push_back(cur);
+}
+
+void Arena::release ()
+{
+	for (auto it = dtors.rbegin(); it != dtors.rend(); ++it)
+		it->second(it->first);
+	dtors.clear();
+	for (char *c: chunks)
+		free(c);
+
+	total_allocations += allocations;
+	total_bytes += bytes;
+	total_chunks += chunks.size();
+
+	chunks.clear();
+	cur = end = NULL;
+	next_chunk = first_chunk;
+	allocations = bytes = 0;
+}
@@ -0,0 +1,67 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+ * Bump allocator owning the IR nodes of one Function.  Nodes are never
+ * freed one by one: release() runs the destructors that are not trivial,
+ * in reverse order of construction, and returns every chunk at once.
+ * Chunks start small and double, so tiny functions stay cheap.  Not
+ * thread-safe; a Function is only ever worked on by one thread at a time.
+ */
+class Arena {
+public:
+	Arena ();
+	~Arena ();
+
+	void *allocate (size_t size, size_t align) {
+		++allocations;
+		bytes += size;
+		uintptr_t p = ((uintptr_t)cur + align - 1) & ~(uintptr_t)(align - 1);
+		if (cur == NULL || p + size > (uintptr_t)end) {
+			grow(size + align);
+			p = ((uintptr_t)cur + align - 1) & ~(uintptr_t)(align - 1);
+		}
+		cur = (char *)(p + size);
+		return (void *)p;
+	}
+
+	template<class T, class... Args> T *make (Args&&... args) {
+		T *p = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+		if (!std::is_trivially_destructible<T>::value)
+			dtors.push_back(std::make_pair((void *)p, &destroy<T>));
+		return p;
+	}
+
+	void release ();
+
+	/* This arena since the last release() */
+	size_t allocations, bytes;
+	size_t chunk_count () const { return chunks.size(); }
+
+	/* Every arena in the process, added up at release() */
+	static std::atomic<size_t> total_allocations, total_bytes, total_chunks;
+
+private:
+	static const size_t first_chunk = 4096, max_chunk = 1 << 20;
+
+	char *cur, *end;
+	size_t next_chunk;
+	std::vector<char *> chunks;
+	std::vector<std::pair<void *, void (*)(void *)> > dtors;
+
+	void grow (size_t min);
+	template<class T> static void destroy (void *p) { ((T *)p)->~T(); }
+
+	Arena (const Arena &) = delete;
+	Arena &operator= (const Arena &) = delete;
+};
+
+#endif
@@ -0,0 +1,459 @@
+#include "arena.h"
+#include "dataflow.h"
+#include "icode.h"
+#include "output.h"
+#include "parse.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <malloc.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double file_mb(const char* path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) return 0;
+    return st.st_size / 1048576.0;
+}
+
+static void report(const char* what, double sec, int rounds, double mb)
+{
+    printf("%-16s %9.3f ms/round  %8.1f MB/s\n", what, sec * 1000 / rounds, mb * rounds / sec);
+}
+
+// Program(FILE*) against the in-place scanner over mmap, construction only
+static int bench_parse(const char* path, int rounds)
+{
+    double t_stdio = 0, t_scan = 0;
+
+    for (int r = 0; r < rounds; ++r) {
+        FILE* in = fopen(path, "r");
+        if (in == NULL) { perror(path); return 1; }
+        double t0 = now();
+        Program* prog = new Program(in);
+        t_stdio += now() - t0;
+        delete prog;
+        fclose(in);
+
+        int fd = open(path, O_RDONLY);
+        t0 = now();
+        {
+            Source src(fd);
+            prog = new Program(src);
+        }
+        t_scan += now() - t0;
+        delete prog;
+        close(fd);
+    }
+
+    double mb = file_mb(path);
+    report("parse/stdio", t_stdio, rounds, mb);
+    report("parse/scan", t_scan, rounds, mb);
+    return 0;
+}
+
+// Text scanner against the binary IR written by Program::binary
+static int bench_load(const char* path, int rounds)
+{
+    char bin[] = "/tmp/bench-XXXXXX";
+    int fd = mkstemp(bin);
+    if (fd < 0) { perror("mkstemp"); return 1; }
+    {
+        int in = open(path, O_RDONLY);
+        if (in < 0) { perror(path); return 1; }
+        Source src(in);
+        Program prog(src);
+        {
+            Output out(fd);
+            prog.binary(out);
+        }
+        close(fd);
+        close(in);
+    }
+
+    double t_text = 0, t_bin = 0;
+    for (int r = 0; r < rounds; ++r) {
+        int in = open(path, O_RDONLY);
+        double t0 = now();
+        Program* prog;
+        {
+            Source src(in);
+            prog = new Program(src);
+        }
+        t_text += now() - t0;
+        delete prog;
+        close(in);
+
+        in = open(bin, O_RDONLY);
+        t0 = now();
+        {
+            Source src(in);
+            prog = new Program(src);
+        }
+        t_bin += now() - t0;
+        delete prog;
+        close(in);
+    }
+
+    report("load/3addr", t_text, rounds, file_mb(path));
+    report("load/bin", t_bin, rounds, file_mb(bin));
+    printf("speedup          %9.1fx\n", t_text / t_bin);
+    unlink(bin);
+    return 0;
+}
+
+// Emission throughput of the 3addr and c backends into /dev/null
+static int bench_emit(const char* path, int rounds)
+{
+    int in = open(path, O_RDONLY);
+    if (in < 0) { perror(path); return 1; }
+    Source src(in);
+    Program prog(src);
+    prog.rename();
+
+    char tmp[] = "/tmp/bench-XXXXXX";
+    int fd = mkstemp(tmp);
+    {
+        Output out(fd);
+        prog.icode(out);
+    }
+    double mb_3addr = file_mb(tmp);
+    ftruncate(fd, 0);
+    lseek(fd, 0, SEEK_SET);
+    {
+        Output out(fd);
+        prog.ccode(out);
+    }
+    double mb_c = file_mb(tmp);
+    close(fd);
+    unlink(tmp);
+
+    int null = open("/dev/null", O_WRONLY);
+    double t_3addr = 0, t_c = 0;
+    for (int r = 0; r < rounds; ++r) {
+        double t0 = now();
+        {
+            Output out(null);
+            prog.icode(out);
+        }
+        t_3addr += now() - t0;
+
+        t0 = now();
+        {
+            Output out(null);
+            prog.ccode(out);
+        }
+        t_c += now() - t0;
+    }
+    close(null);
+    close(in);
+
+    report("emit/3addr", t_3addr, rounds, mb_3addr);
+    report("emit/c", t_c, rounds, mb_c);
+    return 0;
+}
+
+// Node sizes and heap bytes per parsed instruction
+static int bench_layout(const char* path)
+{
+    int in = open(path, O_RDONLY);
+    if (in < 0) { perror(path); return 1; }
+    Source src(in);
+
+    size_t before = mallinfo2().uordblks;
+    Program* prog = new Program(src);
+    size_t heap = mallinfo2().uordblks - before;
+
+    size_t n = 0, vars = 0;
+    for (Function* func : prog->funcs) {
+        vars += func->localvars.size();
+        for (Block* b : func->blocks)
+            n += b->instr.size();
+    }
+
+    printf("sizeof(Operand)     %6zu\n", sizeof(Operand));
+    printf("sizeof(Instruction) %6zu\n", sizeof(Instruction));
+    printf("sizeof(Localvar)    %6zu\n", sizeof(Localvar));
+    printf("instructions        %6zu\n", n);
+    printf("variables           %6zu\n", vars);
+    printf("names               %6zu\n", prog->names.size());
+    printf("heap/instruction    %6.1f bytes\n", n ? (double)heap / n : 0.0);
+    delete prog;
+    close(in);
+    return 0;
+}
+
+// Node allocations and teardown time after parse, SSA and back
+static int bench_arena(const char* path, int rounds)
+{
+    double t_parse = 0, t_free = 0;
+    size_t allocs = Arena::total_allocations, bytes = Arena::total_bytes;
+
+    for (int r = 0; r < rounds; ++r) {
+        int in = open(path, O_RDONLY);
+        if (in < 0) { perror(path); return 1; }
+        double t0 = now();
+        Program* prog;
+        {
+            Source src(in);
+            prog = new Program(src);
+        }
+        t_parse += now() - t0;
+        close(in);
+
+        prog->build_domtree();
+        prog->ssa_prepare();
+        prog->ssa_to_3addr();
+
+        t0 = now();
+        delete prog;
+        t_free += now() - t0;
+    }
+
+    allocs = Arena::total_allocations - allocs;
+    bytes = Arena::total_bytes - bytes;
+    printf("allocations/round   %10zu\n", allocs / rounds);
+    printf("bytes/round         %10zu\n", bytes / rounds);
+    printf("parse               %10.3f ms/round\n", t_parse * 1000 / rounds);
+    printf("teardown            %10.3f ms/round\n", t_free * 1000 / rounds);
+    return 0;
+}
+
+// Dataflow solves behind scp and dse: worklist visits and solve time
+static int bench_dataflow(const char* path, int rounds)
+{
+    double t_scp = 0, t_dse = 0;
+    size_t solves = Dataflow::total_solves, iters = Dataflow::total_iterations;
+    size_t ns = Dataflow::total_nanoseconds, blocks = 0;
+
+    for (int r = 0; r < rounds; ++r) {
+        int in = open(path, O_RDONLY);
+        if (in < 0) { perror(path); return 1; }
+        Program* prog;
+        {
+            Source src(in);
+            prog = new Program(src);
+        }
+        close(in);
+        prog->build_domtree();
+        if (r == 0)
+            for (Function* func : prog->funcs)
+                blocks += func->blocks.size();
+
+        double t0 = now();
+        prog->constant_propagate();
+        t_scp += now() - t0;
+        t0 = now();
+        prog->dead_eliminate();
+        t_dse += now() - t0;
+        delete prog;
+    }
+
+    solves = Dataflow::total_solves - solves;
+    iters = Dataflow::total_iterations - iters;
+    ns = Dataflow::total_nanoseconds - ns;
+    printf("blocks              %10zu\n", blocks);
+    printf("solves/round        %10zu\n", solves / rounds);
+    printf("visits/round        %10zu\n", iters / rounds);
+    printf("solve               %10.3f ms/round\n", ns / 1e6 / rounds);
+    printf("scp                 %10.3f ms/round\n", t_scp * 1000 / rounds);
+    printf("dse                 %10.3f ms/round\n", t_dse * 1000 / rounds);
+    return 0;
+}
+
+// One structured function of about n blocks: nested loops and if/else
+// diamonds over locals, each block a compare and a branch.  With more
+// than one local, the adds are moved into a random one.
+struct Synth {
+    struct Ins { const char* op; int arg; int target; int var; };  // target < 0: none
+    std::vector<Ins> code;
+    unsigned seed;
+    int blocks = 0;
+    int vars = 1;
+
+    int here() const { return (int)code.size(); }
+    unsigned rnd() { seed = seed * 1103515245 + 12345; return seed >> 16; }
+    int pick() { return vars > 1 ? rnd() % vars : 0; }
+    void cond() { code.push_back(Ins{"cmplt", here() - 1, -1, pick()}); }
+    void def()
+    {
+        code.push_back(Ins{"add", 0, -1, pick()});
+        if (vars > 1)
+            code.push_back(Ins{"move", here() - 1, -1, pick()});
+    }
+
+    void region(int depth, int n)
+    {
+        while (blocks < n) {
+            unsigned r = depth >= 24 ? 0 : rnd() % 4;
+            if (r == 0) {
+                def();
+                if (depth > 0) return;
+            } else if (r == 1) {
+                cond();
+                int br = here();
+                code.push_back(Ins{"blbc", here() - 1, 0, 0});
+                region(depth + 1, n);
+                int jmp = here();
+                code.push_back(Ins{"br", 0, 0, 0});
+                code[br].target = here();
+                region(depth + 1, n);
+                code[jmp].target = here();
+                def();
+                blocks += 3;
+            } else {
+                int head = here();
+                cond();
+                int br = here();
+                code.push_back(Ins{"blbc", here() - 1, 0, 0});
+                region(depth + 1, n);
+                code.push_back(Ins{"br", 0, head, 0});
+                code[br].target = here();
+                def();
+                blocks += 2;
+            }
+            if (depth > 0 && rnd() % 2 == 0)
+                return;
+        }
+    }
+
+    void write(FILE* out)
+    {
+        const int base = 4;  // instr 3 is the enter
+        fprintf(out, "instr 1: nop\ninstr 2: entrypc\ninstr 3: enter %d\n", 8 * vars);
+        for (int i = 0; i < here(); ++i) {
+            const Ins& in = code[i];
+            fprintf(out, "instr %d: %s", base + i, in.op);
+            if (in.op[0] == 'a')
+                fprintf(out, " x%d#%d 1\n", in.var, -8 * (in.var + 1));
+            else if (in.op[0] == 'c')
+                fprintf(out, " x%d#%d %d\n", in.var, -8 * (in.var + 1), (int)(rnd() % 100));
+            else if (in.op[0] == 'm')
+                fprintf(out, " (%d) x%d#%d\n", base + in.arg, in.var, -8 * (in.var + 1));
+            else if (in.op[1] == 'l')
+                fprintf(out, " (%d) [%d]\n", base + in.arg, base + in.target);
+            else
+                fprintf(out, " [%d]\n", base + in.target);
+        }
+        int n = base + here();
+        fprintf(out, "instr %d: ret 0\ninstr %d: nop\n", n, n + 1);
+    }
+
+    // Parsed back through a temporary file, as the text frontend sees it
+    Program* program()
+    {
+        char tmp[] = "/tmp/bench-XXXXXX";
+        int fd = mkstemp(tmp);
+        if (fd < 0) { perror("mkstemp"); exit(1); }
+        FILE* out = fdopen(fd, "w");
+        write(out);
+        fclose(out);
+
+        int in = open(tmp, O_RDONLY);
+        Program* prog;
+        {
+            Source src(in);
+            prog = new Program(src);
+        }
+        close(in);
+        unlink(tmp);
+        return prog;
+    }
+};
+
+// build_domtree on synthetic functions from 10 to max blocks
+static int bench_domtree(int max, int rounds)
+{
+    printf("%10s %12s %12s\n", "blocks", "ms", "ns/block");
+    for (int n = 10; n <= max; n *= 10) {
+        Synth syn;
+        syn.seed = n;
+        syn.region(0, n);
+        Program* prog = syn.program();
+
+        double best = 1e30;
+        for (int r = 0; r < rounds; ++r) {
+            double t0 = now();
+            prog->build_domtree();
+            double t = now() - t0;
+            if (t < best) best = t;
+        }
+        size_t blocks = prog->funcs[0]->blocks.size();
+        printf("%10zu %12.3f %12.1f\n", blocks, best * 1000, best * 1e9 / blocks);
+        delete prog;
+    }
+    return 0;
+}
+
+// ssa_prepare on synthetic functions from 10 to max blocks with a local
+// for every other block, phis placed on jobs threads.  Heap is what the
+// SSA form keeps afterwards.
+static int bench_ssa(int max, int rounds, int jobs)
+{
+    printf("%10s %10s %10s %12s %12s\n", "blocks", "vars", "ms", "ns/block", "heap KB");
+    for (int n = 10; n <= max; n *= 10) {
+        Synth syn;
+        syn.seed = n;
+        syn.vars = n / 2;
+        syn.region(0, n);
+
+        double best = 1e30;
+        size_t blocks = 0, heap = 0;
+        for (int r = 0; r < rounds; ++r) {
+            Program* prog = syn.program();
+            prog->set_jobs(jobs);
+            prog->build_domtree();
+            size_t before = mallinfo2().uordblks;
+            double t0 = now();
+            prog->ssa_prepare();
+            double t = now() - t0;
+            heap = mallinfo2().uordblks - before;
+            if (t < best) best = t;
+            blocks = prog->funcs[0]->blocks.size();
+            delete prog;
+        }
+        printf("%10zu %10d %10.3f %12.1f %12zu\n", blocks, syn.vars, best * 1000, best * 1e9 / blocks, heap / 1024);
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s parse|load|emit|layout|arena|dataflow FILE.3addr [ROUNDS]\n"
+                        "       %s domtree|ssa MAXBLOCKS [ROUNDS [JOBS]]\n", argv[0], argv[0]);
+        return 1;
+    }
+    int rounds = argc > 3 ? atoi(argv[3]) : 5;
+
+    if (strcmp(argv[1], "parse") == 0)
+        return bench_parse(argv[2], rounds);
+    if (strcmp(argv[1], "load") == 0)
+        return bench_load(argv[2], rounds);
+    if (strcmp(argv[1], "emit") == 0)
+        return bench_emit(argv[2], rounds);
+    if (strcmp(argv[1], "layout") == 0)
+        return bench_layout(argv[2]);
+    if (strcmp(argv[1], "arena") == 0)
+        return bench_arena(argv[2], rounds);
+    if (strcmp(argv[1], "dataflow") == 0)
+        return bench_dataflow(argv[2], rounds);
+    if (strcmp(argv[1], "domtree") == 0)
+        return bench_domtree(atoi(argv[2]), rounds);
+    if (strcmp(argv[1], "ssa") == 0)
+        return bench_ssa(atoi(argv[2]), rounds, argc > 4 ? atoi(argv[4]) : 1);
+
+    fprintf(stderr, "unknown benchmark: %s\n", argv[1]);
+    return 1;
+}
@@ -0,0 +1,304 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "icode.h"
+#include "output.h"
+#include "parse.h"
+
+/*
+ * Binary IR, version 1.  All integers are host-endian, records are
+ * fixed-size and read with memcpy, so loading does no tokenizing.
+ *
+ *   Header     magic "3ADB", version, #strings, #functions, main index
+ *   strings    u32 length + bytes, each; Program::names without the
+ *              empty string at id 0, so string i is name id i + 1
+ *   function   FuncRec, then VarRec[nvars], BlockRec[nblocks],
+ *              InstrRec[ninstr] in layout (order_next) order
+ *
+ * Operands are a kind byte plus a 32-bit index and a 64-bit value:
+ * CONST keeps its tag as string index + 1, LOCAL indexes the function's
+ * variables, REG its instructions and LABEL its blocks.
+ */
+
+static const char binary_magic[4] = { '3', 'A', 'D', 'B' };
+static const uint32_t binary_version = 1;
+
+namespace {
+
+struct Header {
+	char magic[4];
+	uint32_t version;
+	uint32_t nstrings;
+	uint32_t nfuncs;
+	uint32_t main;
+};
+
+struct FuncRec {
+	int32_t name;
+	int32_t frame_size;
+	int32_t arg_count;
+	uint32_t nvars;
+	uint32_t nblocks;
+	uint32_t ninstr;
+};
+
+struct VarRec {
+	uint32_t name;
+	int64_t offset;
+};
+
+static const uint32_t no_block = UINT32_MAX;
+
+struct BlockRec {
+	int32_t name;
+	uint32_t ninstr;
+	uint32_t seq_next;
+	uint32_t br_next;
+};
+
+struct InstrRec {
+	int32_t name;
+	uint8_t op;
+	uint8_t kind[2];
+	uint8_t pad;
+	uint32_t index[2];
+	int64_t value[2];
+};
+
+struct BinaryWriter {
+	Output *out;
+
+	template<class T> void put (const T &v) { out->put((const char *)&v, sizeof v); }
+};
+
+}
+
+struct BinaryReader {
+	const char *p, *end;
+	std::vector<uint32_t> names;	/* string index to Program::names id */
+
+	template<class T> void get (T &v) {
+		assert((size_t)(end - p) >= sizeof v);
+		memcpy(&v, p, sizeof v);
+		p += sizeof v;
+	}
+};
+
+bool Source::is_binary () const
+{
+	return size >= sizeof binary_magic && memcmp(data, binary_magic, sizeof binary_magic) == 0;
+}
+
+void Program::binary (Output &out)
+{
+	BinaryWriter w;
+	w.out = &out;
+
+	Header h;
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, binary_magic, sizeof h.magic);
+	h.version = binary_version;
+	h.nstrings = names.size() - 1;
+	h.nfuncs = funcs.size();
+	h.main = 0;
+	for (size_t i = 0; i < funcs.size(); ++i)
+		if (funcs[i] == main)
+			h.main = i;
+	w.put(h);
+	for (uint32_t id = 1; id < names.size(); ++id) {
+		uint32_t len = names[id].size();
+		w.put(len);
+		out.put(names[id].data(), len);
+	}
+
+	for (Function *func: funcs) {
+		std::unordered_map<Block*, uint32_t> block_index;
+		std::unordered_map<Instruction*, uint32_t> instr_index;
+		std::unordered_map<Localvar*, uint32_t> var_index;
+		for (Block *b = func->entry; b != NULL; b = b->order_next) {
+			uint32_t n = block_index.size();
+			block_index[b] = n;
+			for (Instruction *ins: b->instr) {
+				n = instr_index.size();
+				instr_index[ins] = n;
+			}
+		}
+		for (size_t i = 0; i < func->localvars.size(); ++i)
+			var_index[func->localvars[i]] = i;
+
+		FuncRec f;
+		memset(&f, 0, sizeof f);
+		f.name = func->name;
+		f.frame_size = func->frame_size;
+		f.arg_count = func->arg_count;
+		f.nvars = func->localvars.size();
+		f.nblocks = block_index.size();
+		f.ninstr = instr_index.size();
+		w.put(f);
+
+		for (Localvar *var: func->localvars) {
+			VarRec v;
+			memset(&v, 0, sizeof v);
+			v.name = var->name - 1;
+			v.offset = var->offset;
+			w.put(v);
+		}
+
+		for (Block *b = func->entry; b != NULL; b = b->order_next) {
+			BlockRec r;
+			memset(&r, 0, sizeof r);
+			r.name = b->name;
+			r.ninstr = b->instr.size();
+			r.seq_next = b->seq_next ? block_index[b->seq_next] : no_block;
+			r.br_next = b->br_next ? block_index[b->br_next] : no_block;
+			w.put(r);
+		}
+
+		for (Block *b = func->entry; b != NULL; b = b->order_next) {
+			for (Instruction *ins: b->instr) {
+				InstrRec r;
+				memset(&r, 0, sizeof r);
+				r.name = ins->name;
+				r.op = ins->op.type;
+				for (int o = 0; o < 2; ++o) {
+					const Operand &oper = ins->oper[o];
+					r.kind[o] = oper.type;
+					switch (oper.type) {
+					case Operand::CONST:
+						r.index[o] = oper.tag;
+						r.value[o] = oper.value_const;
+						break;
+					case Operand::LOCAL:
+						r.index[o] = var_index[oper.var];
+						break;
+					case Operand::REG:
+						assert(instr_index.count(oper.reg) > 0);
+						r.index[o] = instr_index[oper.reg];
+						break;
+					case Operand::LABEL:
+						r.index[o] = block_index[oper.jump];
+						break;
+					case Operand::FUNC:
+						r.value[o] = oper.value_const;
+						break;
+					}
+				}
+				w.put(r);
+			}
+		}
+	}
+}
+
+Function::Function(Program *parent, BinaryReader &in)
+    : prog(parent), is_main(false)
+{
+	FuncRec f;
+	in.get(f);
+	name = f.name;
+	frame_size = f.frame_size;
+	arg_count = f.arg_count;
+
+	for (uint32_t i = 0; i < f.nvars; ++i) {
+		VarRec v;
+		in.get(v);
+		localvars.push_back(arena.make<Localvar>(in.names[v.name], v.offset));
+	}
+
+	std::vector<BlockRec> brec(f.nblocks);
+	for (BlockRec &r: brec)
+		in.get(r);
+
+	std::vector<Instruction*> instr(f.ninstr);
+	for (Instruction *&ins: instr)
+		ins = arena.make<Instruction>();
+
+	auto it = instr.begin();
+	for (BlockRec &r: brec) {
+		assert(r.ninstr > 0);
+		Block *b = arena.make<Block>(this, it, it + r.ninstr);
+		b->name = r.name;
+		blocks.push_back(b);
+		it += r.ninstr;
+	}
+	assert(it == instr.end());
+	entry = blocks.front();
+
+	for (Instruction *ins: instr) {
+		InstrRec r;
+		in.get(r);
+		ins->name = r.name;
+		ins->op.type = (Opcode::Type)r.op;
+		for (int o = 0; o < 2; ++o) {
+			Operand &oper = ins->oper[o];
+			oper.type = (Operand::Type)r.kind[o];
+			switch (oper.type) {
+			case Operand::CONST:
+				if (r.index[o] != 0)
+					oper.tag = in.names[r.index[o] - 1];
+				oper.value_const = r.value[o];
+				break;
+			case Operand::LOCAL:
+				oper.var = localvars[r.index[o]];
+				break;
+			case Operand::REG:
+				oper.reg = instr[r.index[o]];
+				break;
+			case Operand::LABEL:
+				oper.jump = blocks[r.index[o]];
+				break;
+			case Operand::FUNC:
+				oper.value_const = r.value[o];
+				break;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < blocks.size(); ++i) {
+		Block *b = blocks[i];
+		b->order_next = i + 1 < blocks.size() ? blocks[i + 1] : nullptr;
+		if (brec[i].seq_next != no_block) {
+			b->seq_next = blocks[brec[i].seq_next];
+			b->seq_next->prevs.push_back(b);
+		}
+		if (brec[i].br_next != no_block) {
+			b->br_next = blocks[brec[i].br_next];
+			b->br_next->prevs.push_back(b);
+		}
+	}
+
+	index();
+}
+
+void Program::read_binary (const Source &src)
+{
+	BinaryReader in;
+	in.p = src.data;
+	in.end = src.data + src.size;
+
+	Header h;
+	in.get(h);
+	if (memcmp(h.magic, binary_magic, sizeof h.magic) != 0 || h.version != binary_version) {
+		fprintf(stderr, "Unsupported binary program (version %u)\n", h.version);
+		exit(1);
+	}
+
+	in.names.resize(h.nstrings);
+	for (uint32_t &id: in.names) {
+		uint32_t len;
+		in.get(len);
+		assert((size_t)(in.end - in.p) >= len);
+		id = names.intern(in.p, len);
+		in.p += len;
+	}
+
+	for (uint32_t i = 0; i < h.nfuncs; ++i)
+		funcs.push_back(new Function(this, in));
+	assert(h.main < funcs.size());
+	main = funcs[h.main];
+}
@@ -0,0 +1,52 @@
+#include <ctime>
+
+#include "dataflow.h"
+
+std::atomic<size_t> Dataflow::total_solves(0), Dataflow::total_iterations(0), Dataflow::total_nanoseconds(0);
+
+uint64_t Dataflow::now_ns ()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void ReachingDefs::init (Function *f)
+{
+	std::vector<Localvar*> def_var;
+	def.clear();
+	def_bit.assign(f->instrs.size(), -1);
+	for (Localvar *v: f->localvars) if (v->offset > 0) {
+		// Insert function agruments
+		// Instruction after enter
+		def.push_back(f->entry->instr.front());
+		def_var.push_back(v);
+	}
+	size_t nargs = def.size();
+	for (Instruction *i: f->instrs) {
+		if (i->op == Opcode::MOVE && i->oper[1] == Operand::LOCAL) {
+			def_bit[i->id] = def.size();
+			def.push_back(i);
+			def_var.push_back(i->oper[1].var);
+		}
+	}
+	size_t n = def.size();
+	of_var.assign(f->localvars.size(), BitVector(n));
+	args = BitVector(n);
+	for (size_t d = 0; d < n; ++d) {
+		of_var[def_var[d]->id].set(d);
+		if (d < nargs)
+			args.set(d);
+	}
+	gen.assign(f->blocks.size(), BitVector(n));
+	kill.assign(f->blocks.size(), BitVector(n));
+	for (Block *b: f->blocks) {
+		BitVector &g = gen[b->id], &k = kill[b->id];
+		for (Instruction *i: b->instr) if (def_bit[i->id] != -1) {
+			const BitVector &all = of_var[i->oper[1].var->id];
+			g.subtract(all);
+			g.set(def_bit[i->id]);
+			k.union_with(all);
+		}
+	}
+}
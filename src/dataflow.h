@@ -0,0 +1,227 @@
+#ifndef DATAFLOW_H
+#define DATAFLOW_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include "icode.h"
+
+/*
+ * Fixed-size set of small integers, 64 to a word.  The set operations
+ * are plain loops over the words, which the compiler vectorizes.  Bits
+ * past size() are always clear, so whole words can be compared.
+ */
+class BitVector {
+public:
+	BitVector (): bits(0) {}
+	explicit BitVector (size_t n, bool value = false): bits(n), words((n + 63) / 64) { fill(value); }
+
+	size_t size () const { return bits; }
+	bool test (size_t i) const { return words[i / 64] >> (i % 64) & 1; }
+	void set (size_t i) { words[i / 64] |= (uint64_t)1 << (i % 64); }
+	void reset (size_t i) { words[i / 64] &= ~((uint64_t)1 << (i % 64)); }
+
+	void fill (bool value) {
+		for (uint64_t &w: words)
+			w = value ? ~(uint64_t)0 : 0;
+		if (value && bits % 64 != 0)
+			words.back() &= ((uint64_t)1 << (bits % 64)) - 1;
+	}
+
+	/* Each returns whether this set changed */
+	bool union_with (const BitVector &o) {
+		uint64_t diff = 0;
+		for (size_t i = 0; i < words.size(); ++i) {
+			uint64_t w = words[i] | o.words[i];
+			diff |= w ^ words[i];
+			words[i] = w;
+		}
+		return diff != 0;
+	}
+	bool intersect_with (const BitVector &o) {
+		uint64_t diff = 0;
+		for (size_t i = 0; i < words.size(); ++i) {
+			uint64_t w = words[i] & o.words[i];
+			diff |= w ^ words[i];
+			words[i] = w;
+		}
+		return diff != 0;
+	}
+	bool subtract (const BitVector &o) {
+		uint64_t diff = 0;
+		for (size_t i = 0; i < words.size(); ++i) {
+			uint64_t w = words[i] & ~o.words[i];
+			diff |= w ^ words[i];
+			words[i] = w;
+		}
+		return diff != 0;
+	}
+
+	/* this = gen | (in & ~kill) */
+	void transfer (const BitVector &in, const BitVector &gen, const BitVector &kill) {
+		for (size_t i = 0; i < words.size(); ++i)
+			words[i] = gen.words[i] | (in.words[i] & ~kill.words[i]);
+	}
+
+	/* Call f(i) for every member of this & mask, in increasing order */
+	template<class F> void each (const BitVector &mask, F f) const {
+		for (size_t i = 0; i < words.size(); ++i)
+			for (uint64_t w = words[i] & mask.words[i]; w != 0; w &= w - 1)
+				f(i * 64 + __builtin_ctzll(w));
+	}
+
+	bool operator== (const BitVector &o) const { return words == o.words; }
+	bool operator!= (const BitVector &o) const { return words != o.words; }
+	void swap (BitVector &o) { std::swap(bits, o.bits); words.swap(o.words); }
+
+private:
+	size_t bits;
+	std::vector<uint64_t> words;
+};
+
+/*
+ * Shared by every DataflowSolver: the problem shape, and counters added
+ * up over the whole process at the end of each solve().
+ */
+struct Dataflow {
+	enum Direction { FORWARD, BACKWARD };
+	enum Meet { UNION, INTERSECT };
+
+	static std::atomic<size_t> total_solves, total_iterations, total_nanoseconds;
+	static uint64_t now_ns ();
+};
+
+/*
+ * Iterative solver over a Function's CSR CFG.  A Problem supplies
+ *
+ *	static const Dataflow::Direction direction;
+ *	static const Dataflow::Meet meet;
+ *	size_t bits () const;
+ *	void boundary (int block, BitVector &v);
+ *	void transfer (int block, const BitVector &from, BitVector &to);
+ *
+ * boundary() seeds the entry block going forward, and blocks without
+ * successors going backward, before the meet over their neighbours.
+ * in[] and out[] are the sets at block entry and exit in program order
+ * whatever the direction.  Blocks are visited off a worklist ordered by
+ * reverse postorder (forward) or postorder (backward); unreachable
+ * blocks come last.  A transfer function with side effects on other
+ * blocks may push() them back onto the worklist.
+ */
+template<class Problem>
+class DataflowSolver: public Dataflow {
+public:
+	DataflowSolver (Function *func, Problem &problem): func(func), problem(problem),
+		iterations(0), nanoseconds(0) {}
+
+	std::vector<BitVector> in, out;
+
+	/* Of the last solve() */
+	size_t iterations, nanoseconds;
+
+	void solve ();
+
+	void push (int block) {
+		if (!queued[block]) {
+			queued[block] = 1;
+			work.push(rank[block]);
+		}
+	}
+
+private:
+	Function *func;
+	Problem &problem;
+	std::vector<int> order, rank;
+	std::vector<char> queued;
+	std::priority_queue<int, std::vector<int>, std::greater<int> > work;
+};
+
+template<class Problem>
+void DataflowSolver<Problem>::solve ()
+{
+	uint64_t t0 = now_ns();
+	const bool forward = Problem::direction == FORWARD;
+	const bool top = Problem::meet == INTERSECT;
+	int nb = func->blocks.size();
+	size_t bits = problem.bits();
+
+	order = forward ? func->rpo : func->po;
+	rank.assign(nb, -1);
+	for (size_t i = 0; i < order.size(); ++i)
+		rank[order[i]] = i;
+	for (int b = 0; b < nb; ++b) if (rank[b] == -1) {
+		rank[b] = order.size();
+		order.push_back(b);
+	}
+
+	in.assign(nb, BitVector(bits, top));
+	out.assign(nb, BitVector(bits, top));
+	queued.assign(nb, 0);
+	for (int b: order)
+		push(b);
+
+	iterations = 0;
+	BitVector next(bits);
+	while (!work.empty()) {
+		int b = order[work.top()];
+		work.pop();
+		queued[b] = 0;
+		++iterations;
+
+		BitVector &from = forward ? in[b] : out[b];
+		BitVector &to = forward ? out[b] : in[b];
+		IdRange flow = forward ? func->preds(b) : func->succs(b);
+		bool edge = forward ? b == func->entry->id : flow.size() == 0;
+
+		from.fill(top && !edge);
+		if (edge)
+			problem.boundary(b, from);
+		for (int p: flow) {
+			const BitVector &v = forward ? out[p] : in[p];
+			if (top)
+				from.intersect_with(v);
+			else
+				from.union_with(v);
+		}
+
+		problem.transfer(b, from, next);
+		if (next != to) {
+			to.swap(next);
+			for (int s: forward ? func->succs(b) : func->preds(b))
+				push(s);
+		}
+	}
+
+	nanoseconds = now_ns() - t0;
+	total_solves += 1;
+	total_iterations += iterations;
+	total_nanoseconds += nanoseconds;
+}
+
+/*
+ * Reaching definitions: one bit per MOVE to a local, plus one per
+ * argument for the value it has on entry, defined by the ENTER.
+ * init() numbers them and fills in the sets, after index().
+ */
+struct ReachingDefs {
+	static const Dataflow::Direction direction = Dataflow::FORWARD;
+	static const Dataflow::Meet meet = Dataflow::UNION;
+
+	std::vector<Instruction*> def;		// Defining instruction, by bit
+	std::vector<int> def_bit;		// By instruction id, -1 if not a definition
+	std::vector<BitVector> of_var;		// Definitions of each variable
+	std::vector<BitVector> gen, kill;	// By block id
+	BitVector args;
+
+	void init (Function *f);
+	size_t bits () const { return def.size(); }
+	void boundary (int, BitVector &v) { v.union_with(args); }
+	void transfer (int b, const BitVector &in, BitVector &out) { out.transfer(in, gen[b], kill[b]); }
+};
+
+#endif
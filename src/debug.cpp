@@ -1,23 +1,24 @@
 #include "icode.h"
+#include "output.h"
 
 #include <cstdio>
 
-void print_cfg(Program *prog) {
+void print_cfg(Program *prog, Output &out) {
 	for (Function *func: prog->funcs) {
-		printf("Function: %d\n", func->name);
+		out << "Function: " << func->name << '\n';
 
-		printf("Basic blocks:");
+		out << "Basic blocks:";
 		for (Block *b = func->entry; b != NULL; b = b->order_next)
-			printf(" %d", b->name);
+			out << ' ' << b->name;
 
-		printf("\nCFG:\n");
+		out << "\nCFG:\n";
 		for (Block *b = func->entry; b != NULL; b = b->order_next) {
-			printf("%d ->", b->name);
+			out << b->name << " ->";
 			if (b->seq_next != nullptr)
-				printf(" %d", b->seq_next->name);
+				out << ' ' << b->seq_next->name;
 			if (b->br_next != nullptr)
-				printf(" %d", b->br_next->name);
-			putchar('\n');
+				out << ' ' << b->br_next->name;
+			out << '\n';
 		}
 	}
 }
@@ -33,7 +34,7 @@ int main() {
     //prog.ssa_rename_var();
 
     //prog.ssa_licm();
-    //print_cfg(&prog);
+    //print_cfg(&prog, std_out);
 
     //prog.remove_phi();
     //prog.ssa_icode(stdout);
@@ -42,7 +43,7 @@ int main() {
     prog.ssa_licm();
     prog.ssa_to_3addr();
     prog.rename();
-    prog.icode(stdout);
+    prog.icode(std_out);
 
     //prog.icode(stdout);
 
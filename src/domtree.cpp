@@ -0,0 +1,293 @@
+#include <cstdio>
+#include <cstdlib>
+#include <initializer_list>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "icode.h"
+
+/*
+ * Incremental maintenance of idom, domc and dom_depth after CFG edits,
+ * so passes that add or remove edges need not rebuild the tree.  The
+ * dominator tree intervals go stale; number_domtree() refreshes them.
+ * Edges are read from seq_next/br_next and prevs, which the caller has
+ * already rewired, so no index() is needed between updates.
+ */
+
+static void set_idom(Block *b, Block *d)
+{
+	if (b->idom == d)
+		return;
+	if (b->idom != NULL)
+		b->idom->domc.remove(b);
+	b->idom = d;
+	d->domc.push_back(b);
+}
+
+/* Depths below root, after root moved in the tree */
+static void update_depths(Block *root)
+{
+	std::vector<Block*> stack(1, root);
+	while (!stack.empty()) {
+		Block *b = stack.back();
+		stack.pop_back();
+		for (Block *c: b->domc) {
+			c->dom_depth = b->dom_depth + 1;
+			stack.push_back(c);
+		}
+	}
+}
+
+static Block *nca(Block *a, Block *b)
+{
+	while (a != b) {
+		if (a->dom_depth < b->dom_depth)
+			std::swap(a, b);
+		a = a->idom;
+	}
+	return a;
+}
+
+/*
+ * Depth-based search of Georgiadis et al.: with d = nca(from, to), the
+ * blocks whose idom becomes d are those reachable from to along paths
+ * that never climb above their own depth, visited deepest first.
+ */
+void Function::dom_insert_edge(Block *from, Block *to)
+{
+	if (from->dom_depth < 0)
+		return;
+	if (to->dom_depth < 0) {
+		/* A region came alive, its blocks have no tree to update */
+		index();
+		build_domtree();
+		return;
+	}
+
+	Block *d = nca(from, to);
+	if (d == to || d == to->idom)
+		return;
+
+	typedef std::pair<int, Block*> level;
+	std::priority_queue<level> bucket;
+	std::unordered_set<Block*> visited;
+	std::vector<Block*> affected;
+	bucket.push(level(to->dom_depth, to));
+	visited.insert(to);
+	while (!bucket.empty()) {
+		Block *b = bucket.top().second;
+		int depth = b->dom_depth;
+		bucket.pop();
+		affected.push_back(b);
+
+		/* Deeper blocks on the way are walked through but not affected */
+		std::vector<Block*> through;
+		for (;;) {
+			for (Block *s: { b->seq_next, b->br_next }) {
+				if (s == NULL || s->dom_depth <= d->dom_depth + 1 || !visited.insert(s).second)
+					continue;
+				if (s->dom_depth > depth)
+					through.push_back(s);
+				else
+					bucket.push(level(s->dom_depth, s));
+			}
+			if (through.empty())
+				break;
+			b = through.back();
+			through.pop_back();
+		}
+	}
+
+	for (Block *b: affected)
+		set_idom(b, d);
+	for (Block *b: affected) {
+		b->dom_depth = d->dom_depth + 1;
+		update_depths(b);
+	}
+}
+
+/*
+ * Cooper, Harvey and Kennedy over the subtree of root alone.  Leaves
+ * the subtree's blocks reached from root in rpo with their idoms as
+ * ranks in it, and maps every subtree block to its rank, -1 if no
+ * longer reached.  No path into the subtree avoids root, so its other
+ * blocks need only look at predecessors inside it.
+ */
+static void subtree_idoms(Block *root, std::unordered_map<Block*, int> &member,
+	std::vector<Block*> &rpo, std::vector<int> &idom)
+{
+	member.clear();
+	std::vector<Block*> stack(1, root);
+	while (!stack.empty()) {
+		Block *b = stack.back();
+		stack.pop_back();
+		member[b] = -1;
+		for (Block *c: b->domc)
+			stack.push_back(c);
+	}
+
+	std::vector<Block*> po;
+	std::vector<std::pair<Block*, int> > dfs;
+	member[root] = 0;
+	dfs.push_back(std::make_pair(root, 0));
+	while (!dfs.empty()) {
+		Block *b = dfs.back().first;
+		int next = dfs.back().second++;
+		if (next < 2) {
+			Block *s = next == 0 ? b->seq_next : b->br_next;
+			auto m = member.find(s);
+			if (s != NULL && m != member.end() && m->second == -1) {
+				m->second = 0;
+				dfs.push_back(std::make_pair(s, 0));
+			}
+		} else {
+			po.push_back(b);
+			dfs.pop_back();
+		}
+	}
+	rpo.assign(po.rbegin(), po.rend());
+	for (size_t i = 0; i < rpo.size(); ++i)
+		member[rpo[i]] = i;
+
+	idom.assign(rpo.size(), -1);
+	idom[0] = 0;
+	auto intersect = [&](int a, int b) {
+		while (a != b) {
+			while (a > b)
+				a = idom[a];
+			while (b > a)
+				b = idom[b];
+		}
+		return a;
+	};
+	bool change;
+	do {
+		change = false;
+		for (size_t i = 1; i < rpo.size(); ++i) {
+			int nd = -1;
+			for (Block *p: rpo[i]->prevs) {
+				auto m = member.find(p);
+				if (m == member.end() || m->second == -1 || idom[m->second] == -1)
+					continue;
+				nd = nd == -1 ? m->second : intersect(m->second, nd);
+			}
+			if (nd != idom[i]) {
+				idom[i] = nd;
+				change = true;
+			}
+		}
+	} while (change);
+}
+
+/*
+ * Removing an edge can only move idoms down inside the subtree of
+ * d = nca(from, to), or drop blocks out of the tree.  Blocks dropped
+ * take their own edges with them, so if those led out of the subtree
+ * the rebuild moves up to cover their targets as well.
+ */
+void Function::dom_delete_edge(Block *from, Block *to)
+{
+	if (from->dom_depth < 0 || to->dom_depth < 0)
+		return;
+	Block *d = nca(from, to);
+	if (d == to)
+		return;	/* A back edge: every simple path reaches to first */
+
+	std::unordered_map<Block*, int> member;
+	std::vector<Block*> rpo;
+	std::vector<int> idom;
+	for (;;) {
+		subtree_idoms(d, member, rpo, idom);
+		Block *up = d;
+		for (auto &m: member) if (m.second == -1)
+			for (Block *s: { m.first->seq_next, m.first->br_next })
+				if (s != NULL && s->dom_depth >= 0 && member.count(s) == 0)
+					up = nca(up, s);
+		if (up == d)
+			break;
+		d = up;
+	}
+
+	for (auto &m: member) if (m.second == -1) {
+		Block *b = m.first;
+		if (b->idom != NULL && member[b->idom] != -1)
+			b->idom->domc.remove(b);
+		b->idom = NULL;
+		b->domc.clear();
+		b->dom_depth = b->dom_pre = b->dom_post = -1;
+	}
+	for (size_t i = 1; i < rpo.size(); ++i)
+		set_idom(rpo[i], rpo[idom[i]]);
+	update_depths(d);
+}
+
+/* bottom takes over top's successors and top now only falls into it */
+void Function::dom_split_block(Block *top, Block *bottom)
+{
+	if (top->dom_depth < 0)
+		return;
+	bottom->domc.swap(top->domc);
+	for (Block *c: bottom->domc)
+		c->idom = bottom;
+	bottom->idom = top;
+	top->domc.push_back(bottom);
+	bottom->dom_depth = top->dom_depth + 1;
+	update_depths(bottom);
+}
+
+/*
+ * pre now takes every edge into header from outside its loop and falls
+ * into header.  Latches are dominated by header, so header's idom was
+ * the nca of the outside edges; pre takes its place.
+ */
+void Function::dom_insert_preheader(Block *pre, Block *header)
+{
+	if (header->idom == NULL)
+		return;	/* Unreachable, or the entry, which pre cannot reach */
+	Block *d = header->idom;
+	d->domc.remove(header);
+	pre->idom = d;
+	d->domc.push_back(pre);
+	pre->domc.assign(1, header);
+	header->idom = pre;
+	pre->dom_depth = d->dom_depth + 1;
+	update_depths(pre);
+}
+
+/* Compare the maintained tree with one built from scratch, abort on mismatch */
+void Function::dom_verify()
+{
+	index();
+	std::vector<int> idom = compute_idoms();
+	bool ok = true;
+	size_t children = 0, reached = 0;
+	for (Block *b: blocks) {
+		children += b->domc.size();
+		reached += b != entry && idom[b->id] != -1;
+		Block *want = idom[b->id] == -1 || b == entry ? NULL : blocks[idom[b->id]];
+		if (b->idom != want) {
+			fprintf(stderr, "function %d: block %d has idom %d, expected %d\n", name, b->name,
+				b->idom ? b->idom->name : -1, want ? want->name : -1);
+			ok = false;
+		}
+		int depth = idom[b->id] == -1 ? -1 : b == entry ? 0 : b->idom ? b->idom->dom_depth + 1 : -1;
+		if (b->dom_depth != depth) {
+			fprintf(stderr, "function %d: block %d has depth %d, expected %d\n", name, b->name,
+				b->dom_depth, depth);
+			ok = false;
+		}
+		for (Block *c: b->domc) if (c->idom != b) {
+			fprintf(stderr, "function %d: block %d is a stray child of %d\n", name, c->name, b->name);
+			ok = false;
+		}
+	}
+	if (children != reached) {
+		fprintf(stderr, "function %d: %zu tree edges for %zu dominated blocks\n", name, children, reached);
+		ok = false;
+	}
+	if (!ok)
+		abort();
+}
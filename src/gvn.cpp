@@ -0,0 +1,236 @@
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "icode.h"
+#include "output.h"
+
+using std::vector;
+using std::pair;
+using std::make_pair;
+
+/*
+ * Dominator-based global value numbering, after Briggs, Cooper and
+ * Simpson, "Value Numbering".  The dominator tree is walked in preorder
+ * with a table from expression to the instruction that first computed
+ * it; leaving a block takes its entries out again, so a hit is always
+ * computed on every path to the redundant instruction.  Such an
+ * instruction goes, its uses reading the dominating result instead.
+ *
+ * An operand's key is a constant, GP, FP, or the value number of an SSA
+ * value.  A move gives its target the number of its source and removed
+ * instructions that of their replacement, so chains through copies
+ * match too.  Operands of add, mul and cmpeq are put in order first.
+ *
+ * Registers do not survive a call, the callee's instructions write the
+ * same ones.  Entries carry the generation they were made in, and a
+ * call, or a block some path from its idom to it calls on the way,
+ * starts a new one that older entries are not good for.
+ */
+
+namespace {
+
+struct Key {
+    enum Kind : char { CONST, GP, FP, VALUE } kind;
+    long long v;
+
+    bool operator== (const Key& o) const { return kind == o.kind && v == o.v; }
+    bool operator< (const Key& o) const { return kind != o.kind ? kind < o.kind : v < o.v; }
+};
+
+struct Expr {
+    Opcode::Type op;
+    Key a, b;
+
+    bool operator== (const Expr& o) const { return op == o.op && a == o.a && b == o.b; }
+};
+
+struct ExprHash {
+    size_t operator() (const Expr& e) const
+    {
+        size_t h = std::hash<long long>()(e.a.v) * 31 + e.a.kind;
+        h = (h * 31 + std::hash<long long>()(e.b.v)) * 31 + e.b.kind;
+        return h * 31 + e.op;
+    }
+};
+
+bool commutative(Opcode::Type op)
+{
+    return op == Opcode::ADD || op == Opcode::MUL || op == Opcode::CMPEQ;
+}
+
+struct Entry {
+    Instruction* in;
+    int gen;
+};
+
+class Gvn {
+public:
+    Gvn(Function* f);
+    int run();
+
+private:
+    Function* f;
+    vector<Key> number;  // By value id
+    std::unordered_map<Expr, Entry, ExprHash> table;
+    vector<pair<Expr, Entry> > scope;  // What the blocks on the tree path overwrote, in order
+    vector<char> calls;                // By block id
+    bool any_call = false;
+    vector<int> seen;                  // By block id, stamp of the last search
+    int gen = 0, floor = 0;            // Entries older than floor are not good
+
+    bool key(const Operand& o, Key& k) const;
+    bool call_on_way(Block* b);
+    int visit(Block* b);
+};
+
+Gvn::Gvn(Function* f): f(f), number(f->value_block.size()),
+    calls(f->blocks.size(), 0), seen(f->blocks.size(), 0)
+{
+    for (size_t v = 0; v < number.size(); ++v)
+        number[v] = Key{ Key::VALUE, (long long)v };
+    for (Block* b : f->blocks)
+        for (Instruction* in : b->instr)
+            if (in->op == Opcode::CALL)
+                calls[b->id] = any_call = true;
+}
+
+bool Gvn::key(const Operand& o, Key& k) const
+{
+    switch (o.type) {
+    case Operand::CONST:
+        k = Key{ Key::CONST, o.value_const };
+        return true;
+    case Operand::GP:
+        k = Key{ Key::GP, 0 };
+        return true;
+    case Operand::FP:
+        k = Key{ Key::FP, 0 };
+        return true;
+    default: {
+        int v = f->value_of(o);
+        if (v < 0)
+            return false;
+        k = number[v];
+        return true;
+    }
+    }
+}
+
+/* Whether a path from b's idom to b, b's own loop included, calls */
+bool Gvn::call_on_way(Block* b)
+{
+    int stamp = b->id + 1;
+    vector<Block*> work(b->prevs);
+    seen[b->idom->id] = stamp;
+    while (!work.empty()) {
+        Block* x = work.back();
+        work.pop_back();
+        if (seen[x->id] == stamp) continue;
+        seen[x->id] = stamp;
+        if (calls[x->id])
+            return true;
+        work.insert(work.end(), x->prevs.begin(), x->prevs.end());
+    }
+    return false;
+}
+
+/* Numbers the instructions of b, returns how many went */
+int Gvn::visit(Block* b)
+{
+    int eliminated = 0;
+    for (Instruction* in : b->instr) {
+        if (in->op == Opcode::NOP) continue;
+        if (in->op == Opcode::CALL) {
+            floor = ++gen;
+            continue;
+        }
+        if (in->is_move()) {
+            int v = f->value_of(in->oper[1]);
+            Key k;
+            if (v >= 0 && key(in->oper[0], k))
+                number[in->id] = number[v] = k;
+            continue;
+        }
+        int fold = in->op.traits_of().fold;
+        Expr e;
+        e.op = in->op;
+        e.b = Key{ Key::CONST, 0 };
+        if (fold == 0 || !key(in->oper[0], e.a) || (fold > 1 && !key(in->oper[1], e.b)))
+            continue;
+        if (commutative(e.op) && e.b < e.a)
+            std::swap(e.a, e.b);
+
+        auto hit = table.find(e);
+        if (hit == table.end() || hit->second.gen < floor) {
+            Entry old = { nullptr, 0 };
+            if (hit != table.end())
+                old = hit->second;
+            scope.push_back(make_pair(e, old));
+            table[e] = Entry{ in, floor };
+            continue;
+        }
+        Operand r;
+        r.type = Operand::REG;
+        r.reg = hit->second.in;
+        number[in->id] = number[r.reg->id];
+        f->replace_all_uses(in->id, r);
+        in->erase();
+        ++eliminated;
+    }
+    return eliminated;
+}
+
+int Gvn::run()
+{
+    int eliminated = 0;
+    vector<int> floor_out(f->blocks.size(), 0);  // By block id, floor on leaving it
+    // (block, 0), then (block, ~scope size on entry) once visited
+    vector<pair<Block*, long> > stack(1, make_pair(f->entry, 0L));
+    while (!stack.empty()) {
+        Block* b = stack.back().first;
+        long mark = stack.back().second;
+        if (mark < 0) {
+            stack.pop_back();
+            for (long n = ~mark; (long)scope.size() > n; scope.pop_back()) {
+                const pair<Expr, Entry>& old = scope.back();
+                if (old.second.in == nullptr)
+                    table.erase(old.first);
+                else
+                    table[old.first] = old.second;
+            }
+            continue;
+        }
+        stack.back().second = ~(long)scope.size();
+        if (b != f->entry && any_call) {
+            floor = floor_out[b->idom->id];
+            if (call_on_way(b))
+                floor = ++gen;
+        }
+        eliminated += visit(b);
+        floor_out[b->id] = floor;
+        for (Block* c : b->domc)
+            stack.push_back(make_pair(c, 0L));
+    }
+    return eliminated;
+}
+
+}
+
+void Function::ssa_gvn()
+{
+    ssa_index();
+    int eliminated = Gvn(this).run();
+
+    if (prog->output_report) {
+        report(std_out, "Function: %d\n", name);
+        report(std_out, "Number of redundant instructions eliminated (GVN): %d\n", eliminated);
+    }
+}
+
+void Program::ssa_gvn()
+{
+    each_function(&Function::ssa_gvn);
+}
@@ -1,70 +1,27 @@
 
 #include <cstdio>
+#include <cstdarg>
 #include <cstdlib>
 #include <cstring>
 #include <cassert>
 #include <climits>
 #include <cstdint>
+#include <algorithm>
 #include <set>
+#include <utility>
 
+#include "dataflow.h"
 #include "icode.h"
+#include "output.h"
+#include "pool.h"
 
-bool output_report = false;
-
-const char *const Opcode::opname[OPCODE_MAX] = {
-	[UNKNOWN]="unknown",
-	[ADD]="add",
-	[SUB]="sub",
-	[MUL]="mul",
-	[DIV]="div",
-	[MOD]="mod",
-	[NEG]="neg",
-	[CMPEQ]="cmpeq",
-	[CMPLE]="cmple",
-	[CMPLT]="cmplt",
-	[NOP]="nop",
-	[BR]="br",
-	[BLBC]="blbc",
-	[BLBS]="blbs",
-	[CALL]="call",
-	[LOAD]="load",
-	[STORE]="store",
-	[MOVE]="move",
-	[READ]="read",
-	[WRITE]="write",
-	[WRL]="wrl",
-	[PARAM]="param",
-	[ENTER]="enter",
-	[RET]="ret",
-	[ENTRYPC]="entrypc",
-};
-
-const int Opcode::operand_count[OPCODE_MAX] = {
-	[UNKNOWN]=-1,
-	[ADD]=2, [SUB]=2, [MUL]=2, [DIV]=2, [MOD]=2, [NEG]=1,
-	[CMPEQ]=2, [CMPLE]=2, [CMPLT]=2,
-	[NOP]=0,
-	[BR]=1, [BLBC]=2, [BLBS]=2,
-	[CALL]=1,
-	[LOAD]=1,
-	[STORE]=2,
-	[MOVE]=2,
-	[READ]=0,
-	[WRITE]=1,
-	[WRL]=0,
-	[PARAM]=1,
-	[ENTER]=1,
-	[RET]=1,
-	[ENTRYPC]=0,
-};
-
-bool Program::ssa_mode;
+constexpr Opcode::Traits Opcode::traits[OPCODE_MAX];
 
 Opcode::Opcode (const char *name):
 	Opcode()
 {
 	for (int i = 1; i < OPCODE_MAX; ++i) {
-		if (strcmp(name, opname[i]) == 0) {
+		if (strcmp(name, traits[i].name) == 0) {
 			type = (Type) i;
 			break;
 		}
@@ -73,7 +30,25 @@ Opcode::Opcode (const char *name):
 		fprintf(stderr, "Unkown Opcode: %s\n", name);
 }
 
-Operand::Operand (const char *str):
+Names::Names ()
+{
+	intern("", 0);
+}
+
+uint32_t Names::intern (const char *str, size_t len)
+{
+	std::string s(str, len);
+	auto it = ids.find(s);
+	if (it != ids.end())
+		return it->second;
+	uint32_t id = strings.size();
+	assert(id < 1u << 24);
+	strings.push_back(s);
+	ids.emplace(std::move(s), id);
+	return id;
+}
+
+Operand::Operand (const char *str, Names &names):
 	Operand()
 {
 	if (str == NULL) {
@@ -96,7 +71,7 @@ Operand::Operand (const char *str):
 		} else {
 			_value = atoll(sharp+1);
 			int len = sharp - str;
-			tag.assign(str, len);
+			tag = names.intern(str, len);
 			if (len >= 5 && strncmp(str + len - 5, "_base", 5) == 0) {
 				type = CONST;
 			} else if (len >= 7 && strncmp(str + len - 7 ,"_offset", 7) == 0) {
@@ -108,71 +83,71 @@ Operand::Operand (const char *str):
 	}
 }
 
-void Operand::icode (FILE *out) const
+void Operand::icode (Output &out, const Names &names) const
 {
 	switch (type) {
 	case GP:
-		fprintf(out, "GP");
+		out << "GP";
 		break;
 	case FP:
-		fprintf(out, "FP");
+		out << "FP";
 		break;
 	case CONST:
-		if (tag.empty())
-			fprintf(out, "%lld", value_const);
+		if (tag == 0)
+			out << value_const;
 		else
-			fprintf(out, "%s#%lld", tag.c_str(), value_const);
+			out << names[tag] << '#' << value_const;
 		break;
 	case LOCAL:
 		if (ssa_idx == -1)// || !Program::ssa_mode)
-			fprintf(out, "%s#%lld", var->name.c_str(), var->offset);
+			out << names[var->name] << '#' << var->offset;
 		else
-			fprintf(out, "%s$%d", var->name.c_str(), ssa_idx);
+			out << names[var->name] << '$' << ssa_idx;
 		break;
 	case REG:
-		fprintf(out, "(%d)", reg->name);
+		out << '(' << reg->name << ')';
 		break;
 	case LABEL:
-		fprintf(out, "[%d]", jump->name);
+		out << '[' << jump->name << ']';
 		break;
 	case FUNC:
-		fprintf(out, "[%lld]", value_const);
+		out << '[' << value_const << ']';
 		break;
 	default:
 		assert(true);
 	}
 }
 
-void Operand::ccode (FILE *out) const
+void Operand::ccode (Output &out) const
 {
 	switch (type) {
 	case GP:
-		fprintf(out, "GP");
+		out << "GP";
 		break;
 	case FP:
-		fprintf(out, "FP");
+		out << "FP";
 		break;
 	case CONST:
-		fprintf(out, "%lld", value_const);
+		out << value_const;
 		break;
 	case LOCAL:
-		fprintf(out, "LOCAL(%lld)", var->offset);
+		out << "LOCAL(" << var->offset << ')';
 		break;
 	case REG:
-		fprintf(out, "r[%d]", reg->name);
+		out << "r[" << reg->name << ']';
 		break;
 	case LABEL:
-		fprintf(out, "instr_%d", jump->name);
+		out << "instr_" << jump->name;
 		break;
 	case FUNC:
-		fprintf(out, "func_%lld", value_const);
+		out << "func_" << value_const;
 		break;
 	default:
 		assert(false);
 	}
 }
 
-Instruction::Instruction (FILE *in)
+Instruction::Instruction (FILE *in, Names &names)
 {
 	char buf[201];
 	int ret;
@@ -184,11 +159,11 @@ Instruction::Instruction (FILE *in)
 	op = Opcode(buf);
 	if (op.operands() >= 1) {
 		fscanf(in, "%200s", buf);
-		oper[0] = Operand(buf);
+		oper[0] = Operand(buf, names);
 	}
 	if (op.operands() >= 2) {
 		fscanf(in, "%200s", buf);
-		oper[1] = Operand(buf);
+		oper[1] = Operand(buf, names);
 	}
 	if (op == Opcode::CALL) {
 		assert(oper[0].type == Operand::LABEL);
@@ -196,92 +171,92 @@ Instruction::Instruction (FILE *in)
 	}
 }
 
-void Instruction::icode (FILE *out) const
+void Instruction::icode (Output &out, const Names &names) const
 {
-	fprintf(out, "instr %d: %s", name, op.name());
+	out << "instr " << name << ": " << op.name();
 	if (oper[0]) {
-		fprintf(out, " ");
-		oper[0].icode(out);
+		out << ' ';
+		oper[0].icode(out, names);
 	}
 	if (oper[1]) {
-		fprintf(out, " ");
-		oper[1].icode(out);
+		out << ' ';
+		oper[1].icode(out, names);
 	}
-	fprintf(out, "\n");
+	out << '\n';
 }
 
-void Instruction::ccode (FILE *out) const
+void Instruction::ccode (Output &out) const
 {
-	fprintf(out, "instr_%d: ", name);
+	out << "instr_" << name << ": ";
 	switch(op) {
 	case Opcode::ADD:
-		fprintf(out, "r[%d] = ", name); oper[0].ccode(out); fprintf(out, " + "); oper[1].ccode(out);
+		out << "r[" << name << "] = "; oper[0].ccode(out); out << " + "; oper[1].ccode(out);
 		break;
 	case Opcode::SUB:
-		fprintf(out, "r[%d] = ", name); oper[0].ccode(out); fprintf(out, " - "); oper[1].ccode(out);
+		out << "r[" << name << "] = "; oper[0].ccode(out); out << " - "; oper[1].ccode(out);
 		break;
 	case Opcode::MUL:
-		fprintf(out, "r[%d] = ", name); oper[0].ccode(out); fprintf(out, " * "); oper[1].ccode(out);
+		out << "r[" << name << "] = "; oper[0].ccode(out); out << " * "; oper[1].ccode(out);
 		break;
 	case Opcode::DIV:
-		fprintf(out, "r[%d] = ", name); oper[0].ccode(out); fprintf(out, " / "); oper[1].ccode(out);
+		out << "r[" << name << "] = "; oper[0].ccode(out); out << " / "; oper[1].ccode(out);
 		break;
 	case Opcode::MOD:
-		fprintf(out, "r[%d] = ", name); oper[0].ccode(out); fprintf(out, " %% "); oper[1].ccode(out);
+		out << "r[" << name << "] = "; oper[0].ccode(out); out << " % "; oper[1].ccode(out);
 		break;
 	case Opcode::NEG:
-		fprintf(out, "r[%d] = ", name); fprintf(out, "- "); oper[0].ccode(out);
+		out << "r[" << name << "] = "; out << "- "; oper[0].ccode(out);
 		break;
 	case Opcode::CMPEQ:
-		fprintf(out, "r[%d] = ", name); oper[0].ccode(out); fprintf(out, " == "); oper[1].ccode(out);
+		out << "r[" << name << "] = "; oper[0].ccode(out); out << " == "; oper[1].ccode(out);
 		break;
 	case Opcode::CMPLE:
-		fprintf(out, "r[%d] = ", name); oper[0].ccode(out); fprintf(out, " <= "); oper[1].ccode(out);
+		out << "r[" << name << "] = "; oper[0].ccode(out); out << " <= "; oper[1].ccode(out);
 		break;
 	case Opcode::CMPLT:
-		fprintf(out, "r[%d] = ", name); oper[0].ccode(out); fprintf(out, " < "); oper[1].ccode(out);
+		out << "r[" << name << "] = "; oper[0].ccode(out); out << " < "; oper[1].ccode(out);
 		break;
 	case Opcode::BR:
-		fprintf(out, "goto "); oper[0].ccode(out);
+		out << "goto "; oper[0].ccode(out);
 		break;
 	case Opcode::BLBC:
-		fprintf(out, "if ("); oper[0].ccode(out); fprintf(out, "== 0) goto "); oper[1].ccode(out);
+		out << "if ("; oper[0].ccode(out); out << "== 0) goto "; oper[1].ccode(out);
 		break;
 	case Opcode::BLBS:
-		fprintf(out, "if ("); oper[0].ccode(out); fprintf(out, "!= 0) goto "); oper[1].ccode(out);
+		out << "if ("; oper[0].ccode(out); out << "!= 0) goto "; oper[1].ccode(out);
 		break;
 	case Opcode::CALL:
-		fprintf(out, "SP -= 8; MEM(SP) = %d + 1; ", name); oper[0].ccode(out); fprintf(out, "()");
+		out << "SP -= 8; MEM(SP) = " << name << " + 1; "; oper[0].ccode(out); out << "()";
 		break;
 	case Opcode::LOAD:
-		fprintf(out, "r[%d] = MEM(", name); oper[0].ccode(out); fprintf(out, ")");
+		out << "r[" << name << "] = MEM("; oper[0].ccode(out); out << ')';
 		break;
 	case Opcode::STORE:
-		fprintf(out, "MEM("); oper[1].ccode(out); fprintf(out, ") = "); oper[0].ccode(out);
+		out << "MEM("; oper[1].ccode(out); out << ") = "; oper[0].ccode(out);
 		break;
 	case Opcode::MOVE:
-		fprintf(out, "r[%d] = ", name); oper[1].ccode(out); fprintf(out, " = "); oper[0].ccode(out);
+		out << "r[" << name << "] = "; oper[1].ccode(out); out << " = "; oper[0].ccode(out);
 		break;
 	case Opcode::READ:
-		fprintf(out, "ReadLong(r[%d])", name);
+		out << "ReadLong(r[" << name << "])";
 		break;
 	case Opcode::WRITE:
-		fprintf(out, "WriteLong("); oper[0].ccode(out); fprintf(out, ")");
+		out << "WriteLong("; oper[0].ccode(out); out << ')';
 		break;
 	case Opcode::WRL:
-		fprintf(out, "WriteLine()");
+		out << "WriteLine()";
 		break;
 	case Opcode::PARAM:
-		fprintf(out, "SP -= 8; MEM(SP) = "); oper[0].ccode(out);
+		out << "SP -= 8; MEM(SP) = "; oper[0].ccode(out);
 		break;
 	case Opcode::ENTER:
-		fprintf(out, "SP -= 8; MEM(SP) = FP; FP = SP; SP -= "); oper[0].ccode(out);
+		out << "SP -= 8; MEM(SP) = FP; FP = SP; SP -= "; oper[0].ccode(out);
 		break;
 	case Opcode::RET:
-		fprintf(out, "SP = FP + 16 + "); oper[0].ccode(out); fprintf(out, "; FP = MEM(FP)");
+		out << "SP = FP + 16 + "; oper[0].ccode(out); out << "; FP = MEM(FP)";
 		break;
 	}
-	fprintf(out, ";\n");
+	out << ";\n";
 }
 
 int Instruction::get_branch_oper () const
@@ -318,21 +293,10 @@ bool Instruction::falldown() const
 }
 
 bool Instruction::isconst() const {
-	switch(op) {
-	case Opcode::ADD:
-	case Opcode::SUB:
-	case Opcode::MUL:
-	case Opcode::DIV:
-	case Opcode::MOD:
-	case Opcode::CMPEQ:
-	case Opcode::CMPLE:
-	case Opcode::CMPLT:
-		return oper[0].type == Operand::CONST && oper[1].type == Operand::CONST;
-	case Opcode::NEG:
-	case Opcode::MOVE:
-		return oper[0].type == Operand::CONST;
-	}
-	return false;
+	int n = op.traits_of().fold;
+	if (n == 0)
+		return false;
+	return oper[0].type == Operand::CONST && (n < 2 || oper[1].type == Operand::CONST);
 }
 
 long long Instruction::constvalue() const {
@@ -362,67 +326,6 @@ long long Instruction::constvalue() const {
 	return 0;
 }
 
-bool Instruction::isrightvalue(int o) const
-{
-	switch (o) {
-	case 0:
-		switch (op) {
-		case Opcode::ADD:
-		case Opcode::SUB:
-		case Opcode::MUL:
-		case Opcode::DIV:
-		case Opcode::MOD:
-		case Opcode::NEG:
-		case Opcode::CMPEQ:
-		case Opcode::CMPLE:
-		case Opcode::CMPLT:
-		case Opcode::BLBC:
-		case Opcode::BLBS:
-		case Opcode::LOAD:
-		case Opcode::STORE:
-		case Opcode::MOVE:
-		case Opcode::WRITE:
-		case Opcode::PARAM:
-			return true;
-		}
-		return false;
-	case 1:
-		switch (op) {
-		case Opcode::ADD:
-		case Opcode::SUB:
-		case Opcode::MUL:
-		case Opcode::DIV:
-		case Opcode::MOD:
-		case Opcode::CMPEQ:
-		case Opcode::CMPLE:
-		case Opcode::CMPLT:
-		case Opcode::STORE:
-			return true;
-		}
-		return false;
-	}
-	return false;
-}
-
-bool Instruction::eliminable() const
-{
-	switch (op) {
-	case Opcode::ADD:
-	case Opcode::SUB:
-	case Opcode::MUL:
-	case Opcode::DIV:
-	case Opcode::MOD:
-	case Opcode::NEG:
-	case Opcode::CMPEQ:
-	case Opcode::CMPLE:
-	case Opcode::CMPLT:
-	case Opcode::LOAD:
-	case Opcode::MOVE:
-		return true;
-	}
-	return false;
-}
-
 void Instruction::erase()
 {
     op.type = Opcode::NOP;
@@ -436,11 +339,16 @@ Program::Program (FILE *in):
 	std::vector<Instruction> instr;
 
 	while (!feof(in)) {
-		instr.push_back(Instruction(in));
+		instr.push_back(Instruction(in, names));
 	}
 	if (!instr.back())
 		instr.pop_back();
 
+	split_functions(instr);
+}
+
+void Program::split_functions (std::vector<Instruction> &instr)
+{
 	for (auto p = instr.begin(), enter = instr.end(); p != instr.end(); ++p) {
 		if (p->op == Opcode::ENTER) {
 			assert(enter == instr.end());
@@ -459,36 +367,60 @@ Program::Program (FILE *in):
 	assert(main != NULL);
 }
 
-void Program::rename()
+int Program::rename(int i)
 {
-	int i = 2;
 	for (Function *func: funcs) {
 		if (func == main)
 			++i;
 		i = func->rename(i);
 	}
+	return i;
 }
 
-void Program::icode (FILE *out)
+void Program::icode (Output &out)
 {
-	ssa_mode = false;
-	fprintf(out, "instr 1: nop\n");
+	icode_head(out);
 	int i;
 
-	for (Function* func : funcs) {
-		if (func == main)
-			fprintf(out, "instr %d: entrypc\n", func->entry->name - 1);
+	for (Function* func : funcs)
+		i = icode(out, func);
 
-		i = func->icode(out);
-	}
+	icode_tail(out, i);
+}
 
-	fprintf(out, "instr %d: nop\n", i);
+void Program::icode_head (Output &out)
+{
+	ssa_mode = false;
+	out << "instr 1: nop\n";
+}
+
+int Program::icode (Output &out, Function *func)
+{
+	if (func == main)
+		out << "instr " << func->entry->name - 1 << ": entrypc\n";
+
+	return func->icode(out);
+}
+
+void Program::icode_tail (Output &out, int i)
+{
+	out << "instr " << i << ": nop\n";
 }
 
 
-void Program::ccode (FILE *out)
+void Program::ccode (Output &out)
 {
-	fprintf(out, "%s",
+	ccode_head(out, main->name);
+
+	for (Function* func : funcs)
+		func->ccode(out);
+
+	ccode_tail(out);
+}
+
+void Program::ccode_head (Output &out, int main_name)
+{
+	out <<
 	"#include <stdio.h>\n"
 	"#define WriteLine() printf(\"\\n\");\n"
 	"#define WriteLong(x) printf(\" %lld\", (long)x);\n"
@@ -502,39 +434,40 @@ void Program::ccode (FILE *out)
 	"long GP = 0;\n"
 	"long SP = 65536;\n"
 	"long FP = 65536;\n"
-	"\n"
-	);
-	fprintf(out, "void func_%d();\nvoid (*entry)() = func_%d;\n\n", main->name, main->name);
-
-	for (Function* func : funcs)
-		func->ccode(out);
+	"\n";
+	out << "void func_" << main_name << "();\nvoid (*entry)() = func_" << main_name << ";\n\n";
+}
 
-	fprintf(out,"void main()\n{\n\t(*entry)();\n}\n");
+void Program::ccode_tail (Output &out)
+{
+	out << "void main()\n{\n\t(*entry)();\n}\n";
 }
 
 void Program::build_domtree()
 {
-	for (Function *f: funcs)
-		f->build_domtree();
+	each_function(&Function::build_domtree);
 }
 
 void Program::constant_propagate()
 {
-	for (Function *f: funcs)
-		f->constant_propagate();
+	each_function(&Function::constant_propagate);
 }
 
 void Program::dead_eliminate()
 {
-	for (Function *f: funcs)
-		f->dead_eliminate();
+	each_function(&Function::dead_eliminate);
+}
+
+void Program::compact()
+{
+	each_function(&Function::compact);
 }
 
 void Operand::to_const(long long val)
 {
     type = Operand::CONST;
     value_const = val;
-    tag.clear();
+    tag = 0;
     ssa_idx = -1;
 }
 
@@ -542,6 +475,50 @@ Program::~Program()
 {
     for (Function* func : funcs)
         delete func;
+    delete pool;
+}
+
+void Program::set_jobs (int jobs)
+{
+	delete pool;
+	pool = jobs > 1 ? new ThreadPool(jobs) : NULL;
+}
+
+/* Run a per-function pass over all functions, in parallel with -jobs */
+void Program::each_function (void (Function::*pass)())
+{
+	if (pool == NULL || funcs.size() < 2) {
+		for (Function *f: funcs)
+			(f->*pass)();
+	} else {
+		pool->run(funcs.size(), [&](size_t i) { (funcs[i]->*pass)(); });
+	}
+	flush_reports();
+}
+
+void Program::flush_reports ()
+{
+	for (Function *f: funcs) {
+		for (auto &r: f->reports)
+			*r.first << r.second;
+		f->reports.clear();
+	}
+	std_err.flush();
+}
+
+void Function::report (Output &stream, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	std::string line(n + 1, '\0');
+	va_start(ap, fmt);
+	vsnprintf(&line[0], n + 1, fmt, ap);
+	va_end(ap);
+	line.resize(n);
+	reports.push_back(std::make_pair(&stream, std::move(line)));
 }
 
 Function::Function(Program *parent, std::vector<Instruction>::iterator begin, std::vector<Instruction>::iterator end)
@@ -554,34 +531,44 @@ Function::Function(Program *parent, std::vector<Instruction>::iterator begin, st
 	frame_size = begin->oper[0]._value/ 8;
 	arg_count = exit->oper[0]._value/ 8;
 
-	std::map<int, int> addr_instr;
+	/* Instruction names are dense in the input, index them by offset */
+	int lo = begin->name, hi = begin->name;
+	for (auto p = begin; p != end; ++p) {
+		lo = std::min(lo, p->name);
+		hi = std::max(hi, p->name);
+	}
+	std::vector<int> addr_instr(hi - lo + 1, -1);
 	std::vector<Instruction*> instr;
 	for (auto p = begin; p != end; ++p) {
-		assert(addr_instr.count(p->name) == 0);
-		addr_instr[p->name] = instr.size();
-		instr.push_back(new Instruction(*p));
+		assert(addr_instr[p->name - lo] == -1);
+		addr_instr[p->name - lo] = instr.size();
+		instr.push_back(arena.make<Instruction>(*p));
 	}
+	auto at = [&](long long addr) {
+		assert(addr >= lo && addr <= hi && addr_instr[addr - lo] != -1);
+		return addr_instr[addr - lo];
+	};
 
-	std::set<int> bounds;  // boundaries of blocks
-	for (int i = 0; i < (int)instr.size(); ++i) {
+	int n = instr.size();
+	std::vector<char> leader(n + 1, 0);  // a block starts at i
+	for (int i = 0; i < n; ++i) {
 		int o = instr[i]->get_branch_oper();
 		if (o != -1 || instr[i]->op == Opcode::CALL)
-			bounds.insert(i + 1);
+			leader[i + 1] = 1;
 		if (o != -1)
-			bounds.insert(addr_instr[instr[i]->oper[o]._value]);
+			leader[at(instr[i]->oper[o]._value)] = 1;
 	}
-	bounds.insert(instr.size());
+	leader[n] = 1;
 
-	std::map<int, Block*> addr_blocks;
-	int st = 0;
-	for (int ed : bounds) {
+	std::vector<Block*> block_at(n + 1, nullptr);
+	for (int st = 0, ed = 1; ed <= n; ++ed) if (leader[ed]) {
 		auto it = instr.begin();
-		Block *b = new Block(this, it + st, it + ed);
-		addr_blocks[b->name] = b;
+		Block *b = arena.make<Block>(this, it + st, it + ed);
+		block_at[st] = b;
 		blocks.push_back(b);
 		st = ed;
 	}
-	entry = addr_blocks[instr[0]->name];
+	entry = block_at[0];
 	name = entry->name;
 
 	std::map<int, Localvar*> vars;
@@ -593,22 +580,22 @@ Function::Function(Program *parent, std::vector<Instruction>::iterator begin, st
 			break;
 		case Operand::LOCAL:
 			if (vars.count(oper._value) == 0) {
-				Localvar *var = new Localvar(oper.tag, oper._value);
+				Localvar *var = arena.make<Localvar>((uint32_t)oper.tag, oper._value);
 				vars[oper._value] = var;
 				localvars.push_back(var);
 				oper.var = var;
-				oper.tag.clear();
+				oper.tag = 0;
 			} else {
 				assert(oper.tag == vars[oper._value]->name);
 				oper.var = vars[oper._value];
-				oper.tag.clear();
+				oper.tag = 0;
 			}
 			break;
 		case Operand::REG:
-			oper.reg = instr[addr_instr[oper._value]];
+			oper.reg = instr[at(oper._value)];
 			break;
 		case Operand::LABEL:
-			oper.jump = addr_blocks[oper._value];
+			oper.jump = block_at[at(oper._value)];
 			break;
 		case Operand::FUNC:
 			oper.value_const = oper._value;
@@ -616,15 +603,14 @@ Function::Function(Program *parent, std::vector<Instruction>::iterator begin, st
 		}
 	}
 
-	st = 0;
-	for (int ed : bounds) {
-		Block *b = addr_blocks[instr[st]->name];
+	for (int st = 0, ed = 1; ed <= n; ++ed) if (leader[ed]) {
+		Block *b = block_at[st];
 
 		Instruction *i = b->instr.back();
-		b->seq_next = i->falldown() ? addr_blocks[instr[ed]->name] : nullptr;
+		b->seq_next = i->falldown() ? block_at[ed] : nullptr;
 		if (b->seq_next)
 			b->seq_next->prevs.push_back(b);
-		b->order_next = (i->op != Opcode::RET) ? addr_blocks[instr[ed]->name] : nullptr;
+		b->order_next = (i->op != Opcode::RET) ? block_at[ed] : nullptr;
 
 		b->br_next = b->instr.back()->get_branch_target();
 		if (b->br_next) {
@@ -634,14 +620,131 @@ Function::Function(Program *parent, std::vector<Instruction>::iterator begin, st
 
 		st = ed;
 	}
+
+	index();
+}
+
+/*
+ * Number blocks in the order of blocks and instructions block by block,
+ * lay the edges out in CSR form and cache the DFS orders, all in time
+ * linear in the function.  Rerun after adding blocks, edges or
+ * instructions and after compacting.
+ */
+void Function::index()
+{
+	int nb = blocks.size();
+	for (size_t i = 0; i < localvars.size(); ++i)
+		localvars[i]->id = i;
+	instrs.clear();
+	for (int i = 0; i < nb; ++i) {
+		Block *b = blocks[i];
+		b->id = i;
+		for (Instruction *ins: b->instr) {
+			ins->id = instrs.size();
+			instrs.push_back(ins);
+		}
+	}
+
+	succ_start.assign(nb + 1, 0);
+	succ_list.clear();
+	pred_start.assign(nb + 1, 0);
+	for (int i = 0; i < nb; ++i) {
+		for (Block *s: { blocks[i]->seq_next, blocks[i]->br_next }) if (s != NULL) {
+			succ_list.push_back(s->id);
+			++pred_start[s->id + 1];
+		}
+		succ_start[i + 1] = succ_list.size();
+	}
+	for (int i = 0; i < nb; ++i)
+		pred_start[i + 1] += pred_start[i];
+	pred_list.resize(succ_list.size());
+	std::vector<int> fill(pred_start.begin(), pred_start.end() - 1);
+	for (int i = 0; i < nb; ++i)
+		for (int s: succs(i))
+			pred_list[fill[s]++] = i;
+
+	/* Iterative DFS, each frame holds its next successor slot */
+	po.clear();
+	std::vector<char> seen(nb, 0);
+	std::vector<std::pair<int, int> > stack;
+	seen[entry->id] = 1;
+	stack.push_back(std::make_pair(entry->id, succ_start[entry->id]));
+	while (!stack.empty()) {
+		int b = stack.back().first, &next = stack.back().second;
+		if (next < succ_start[b + 1]) {
+			int s = succ_list[next++];
+			if (!seen[s]) {
+				seen[s] = 1;
+				stack.push_back(std::make_pair(s, succ_start[s]));
+			}
+		} else {
+			po.push_back(b);
+			stack.pop_back();
+		}
+	}
+	rpo.assign(po.rbegin(), po.rend());
+}
+
+/*
+ * Puts a new block on the edge, laid out right after from so that from
+ * falls into it.  A conditional branch to to is turned around to branch
+ * to from's old fallthrough instead, and the new block ends in a br to
+ * to.  Phis in to now name the new block.  Call index() afterwards.
+ */
+Block *Function::split_edge(Block *from, Block *to)
+{
+	Instruction *nop = arena.make<Instruction>();
+	nop->op.type = Opcode::NOP;
+	std::vector<Instruction*> code(1, nop);
+	Block *mid = arena.make<Block>(this, code.begin(), code.end());
+	Instruction *last = from->instr.back();
+
+	if (from->seq_next == to) {
+		mid->seq_next = to;
+		from->seq_next = mid;
+	} else {
+		Instruction *br = arena.make<Instruction>();
+		br->op.type = Opcode::BR;
+		br->oper[0].type = Operand::LABEL;
+		br->oper[0].jump = to;
+		mid->instr.push_back(br);
+		mid->br_next = to;
+		if (last->op == Opcode::BR) {
+			last->set_branch(mid);
+			from->br_next = mid;
+		} else {
+			last->op.type = last->op == Opcode::BLBC ? Opcode::BLBS : Opcode::BLBC;
+			last->set_branch(from->seq_next);
+			from->br_next = from->seq_next;
+			from->seq_next = mid;
+		}
+	}
+	mid->order_next = from->order_next;
+	from->order_next = mid;
+
+	mid->prevs.push_back(from);
+	for (Block *&p: to->prevs)
+		if (p == from)
+			p = mid;
+	for (Phi &phi: to->phi)
+		for (Block *&p: phi.pre)
+			if (p == from)
+				p = mid;
+	blocks.push_back(mid);
+	return mid;
 }
 
-Function::~Function()
+/* A new scalar just below the frame, which grows by its 8 bytes */
+Localvar *Function::add_local(uint32_t name)
 {
-    for (auto iter : blocks)
-        delete iter;
-    for (auto iter : localvars)
-        delete iter;
+	Instruction *enter = entry->instr.front();
+	assert(enter->op == Opcode::ENTER);
+	enter->oper[0].value_const += 8;
+	++frame_size;
+	Localvar *var = arena.make<Localvar>(name, -enter->oper[0].value_const);
+	var->id = localvars.size();
+	localvars.push_back(var);
+	return var;
 }
 
 int Function::rename(int i)
@@ -649,9 +752,9 @@ int Function::rename(int i)
 	for (Block *p = entry; p != NULL; p = p->order_next) {
 		assert(!p->instr.empty());
 		p->name = i;
-                for (auto& var_phi : p->phi) 
-                    if (!var_phi.second.r.empty()) {
-                        var_phi.second.name = i;
+                for (Phi& phi : p->phi)
+                    if (!phi.r.empty()) {
+                        phi.name = i;
                         i += 2;
                     }
 		for (Instruction *ins: p->instr) if (ins->op != Opcode::NOP) {
@@ -663,9 +766,9 @@ int Function::rename(int i)
 	return i;
 }
 
-void Function::ccode(FILE *out) const
+void Function::ccode(Output &out) const
 {
-	fprintf(out, "void func_%d() {\n", name);
+	out << "void func_" << name << "() {\n";
 
 	for (Block *p = entry; p != NULL; p = p->order_next) {
 		assert(!p->instr.empty());
@@ -673,169 +776,200 @@ void Function::ccode(FILE *out) const
 			ins->ccode(out);
 	}
 
-	fprintf(out, "}\n");
+	out << "}\n";
 }
 
-int Function::icode(FILE *out) const
+int Function::icode(Output &out) const
 {
 	int i;
 	for (Block *p = entry; p != NULL; p = p->order_next) {
 		assert(!p->instr.empty());
-                for (auto& var_phi : p->phi)
-                    var_phi.second.icode(out, var_phi.first);
+                for (const Phi& phi : p->phi)
+                    phi.icode(out, prog->names);
 		for (Instruction *ins: p->instr) if (ins->op != Opcode::NOP)
-			ins->icode(out);
+			ins->icode(out, prog->names);
 		i = p->instr.back()->name;
 	}
 	return i+1;
 }
 
-void Function::build_domtree()
+/*
+ * Immediate dominators by Cooper, Harvey and Kennedy, "A Simple, Fast
+ * Dominance Algorithm": iterate over reverse postorder, intersecting
+ * the dominator tree paths of each block's processed predecessors.
+ * Full dominator sets are never built.  Returns the idom of each block
+ * by id, the entry's being itself and -1 for blocks unreachable from
+ * entry.  Needs a current index().
+ */
+std::vector<int> Function::compute_idoms() const
 {
-	typedef std::set<Block*> blockset;
-	std::map<Block*, blockset> dominators;
-	dominators[entry] = blockset();
-	/* uninitialized set denotes complete set */
+	int nb = blocks.size();
+	std::vector<int> rank(nb, -1); // Position in rpo
+	for (size_t i = 0; i < rpo.size(); ++i)
+		rank[rpo[i]] = i;
+
+	std::vector<int> idom(nb, -1);
+	idom[entry->id] = entry->id;
+	auto intersect = [&](int a, int b) {
+		while (a != b) {
+			while (rank[a] > rank[b])
+				a = idom[a];
+			while (rank[b] > rank[a])
+				b = idom[b];
+		}
+		return a;
+	};
 	bool change;
 	do {
 		change = false;
-		for (Block *b: blocks) {
-			if (dominators.find(b) == dominators.end()) {
-				bool found = false;
-				for (Block *p: b->prevs) {
-					auto pps = dominators.find(p);
-					if (pps != dominators.end()) {
-						dominators[b] = pps->second;
-						dominators[b].insert(p);
-						change = true;
-						found = true;
-						break;
-					}
-				}
-				if (!found)
-					continue;
-			}
-			blockset &bs = dominators.find(b)->second;
-			for (auto p: b->prevs) {
-				auto pps = dominators.find(p);
-				if (pps != dominators.end()) {
-					blockset &ps = pps->second;
-					std::list<Block*> erase;
-					for (Block *i: bs) {
-						if (i != p && ps.find(i) == ps.end()) {
-							erase.push_back(i);
-							change = true;
-						}
-					}
-					for (Block *i: erase)
-						bs.erase(i);
-				}
+		for (size_t i = 1; i < rpo.size(); ++i) {
+			int b = rpo[i], d = -1;
+			for (int p: preds(b)) if (idom[p] != -1)
+				d = d == -1 ? p : intersect(p, d);
+			if (d != idom[b]) {
+				idom[b] = d;
+				change = true;
 			}
 		}
 	} while(change);
-	std::multimap<Block*, Block*> backedge;
-	for (Block *b: blocks) {
-		blockset &bs = dominators.find(b)->second;
-		if (b->seq_next != NULL && bs.find(b->seq_next) != bs.end())
-			backedge.insert(std::make_pair(b->seq_next, b));
-		if (b->br_next != NULL && bs.find(b->br_next) != bs.end())
-			backedge.insert(std::make_pair(b->br_next, b));
-	}
-	for (Block *b: blocks) {
-		auto st = backedge.lower_bound(b), ed = backedge.upper_bound(b);
-		if (st != ed) {
-			loops[b] = blockset();
-			blockset candid, &loop = loops[b];
-			loop.insert(b);
-			for (auto i = st; i != ed; ++i) {
-				candid.insert(i->second);
-				loop.insert(i->second);
-			}
-			while (!candid.empty()) {
-				Block *s = *candid.begin();
-				candid.erase(candid.begin());
-				for (Block *t: s->prevs) if (loop.find(t) == loop.end()) {
-					candid.insert(t);
-					loop.insert(t);
-				}
-			}
-		}
-	}
+	return idom;
+}
+
+/* Unreachable blocks stay out of the tree.  Rebuilds the loops too. */
+void Function::build_domtree()
+{
+	std::vector<int> idom = compute_idoms();
+
 	for (Block *b: blocks) {
 		b->idom = NULL;
 		b->domc.clear();
 	}
 	for (Block *b: blocks) {
-		blockset &bs = dominators.find(b)->second;
-		for (Block *p: bs) {
-			blockset &ps = dominators.find(p)->second;
-			for (Block *i: ps)
-				bs.erase(i);
-		}
-		assert(bs.size() <= 1);
-		for (Block *p: bs) {
-			b->idom = p;
-			p->domc.push_back(b);
+		int d = idom[b->id];
+		if (d != -1 && b != entry) {
+			b->idom = blocks[d];
+			blocks[d]->domc.push_back(b);
 		}
 	}
+
+	number_domtree();
+	build_loops();
 }
 
-void Function::constant_propagate()
+/*
+ * Number the dominator tree in preorder and postorder with an explicit
+ * stack, so a dominates b is an interval test, and set depths.  Rerun
+ * whenever idom or domc change.
+ */
+void Function::number_domtree()
 {
-	// uintptr-t -> Instruction*
-	typedef std::set<std::pair<Localvar*, uintptr_t> > iset; // Set of variable definitions
-	int propa_count = 0;
-	std::map<Block*, iset> rd; // Reaching Definition IN
-	for (Block *b: blocks) {
-		rd[b] = iset();
+	for (Block *b: blocks)
+		b->dom_pre = b->dom_post = b->dom_depth = -1;
+	int pre = 0, post = 0;
+	std::vector<std::pair<Block*, std::list<Block*>::iterator> > stack;
+	entry->dom_pre = pre++;
+	entry->dom_depth = 0;
+	stack.push_back(std::make_pair(entry, entry->domc.begin()));
+	while (!stack.empty()) {
+		Block *b = stack.back().first;
+		auto &next = stack.back().second;
+		if (next != b->domc.end()) {
+			Block *c = *next++;
+			c->dom_pre = pre++;
+			c->dom_depth = stack.size();
+			stack.push_back(std::make_pair(c, c->domc.begin()));
+		} else {
+			b->dom_post = post++;
+			stack.pop_back();
+		}
 	}
-	for (Localvar *v: localvars) if (v->offset > 0)
-		// Insert function agruments
-		// Instruction after enter
-		rd[entry].insert(std::make_pair(v, (uintptr_t)entry->instr.front()));
-	bool change;
-	do {
-		change = false;
-		for (Block *b: blocks) {
-			iset cur = rd[b]; // Copy
-			for (Instruction *i: b->instr) {
-				if (i->op == Opcode::MOVE && i->oper[1] == Operand::LOCAL) {
-					Localvar *def = i->oper[1].var;
-					auto vst = cur.lower_bound(std::make_pair(def, 0));
-					auto ved = cur.lower_bound(std::make_pair(def, UINTPTR_MAX));
-					cur.erase(vst, ved);
-					cur.insert(std::make_pair(def, (uintptr_t)i));
-				}
+}
+
+namespace {
+
+/*
+ * Live variables.  An eliminable instruction only uses its operands
+ * when it is live itself, so registers are marked live as their users
+ * turn out live, and the block defining one is visited again.
+ */
+struct Liveness {
+	static const Dataflow::Direction direction = Dataflow::BACKWARD;
+	static const Dataflow::Meet meet = Dataflow::UNION;
+
+	Function *func;
+	DataflowSolver<Liveness> *solver;
+	std::vector<char> lvreg;		// Live Temporary Registers, by instruction id
+	std::vector<int> block_of;		// By instruction id
+
+	size_t bits () const { return func->localvars.size(); }
+	void boundary (int, BitVector &) {}
+	void transfer (int b, const BitVector &out, BitVector &in);
+};
+
+void Liveness::transfer (int b, const BitVector &out, BitVector &in)
+{
+	in = out;
+	const std::vector<Instruction*> &instr = func->blocks[b]->instr;
+	for (auto j = instr.rbegin(); j != instr.rend(); ++j) {
+		Instruction *i = *j;
+		bool live = !i->eliminable() || lvreg[i->id];
+		if (i->op == Opcode::MOVE && i->oper[1] == Operand::LOCAL) {
+			int def = i->oper[1].var->id;
+			if (in.test(def)) {
+				in.reset(def);
+				live = true;
 			}
-			for (int t = 0; t < 2; ++t) {
-				Block *b2 = t == 0 ? b->seq_next : b->br_next;
-				if (b2 != NULL) {
-					iset &in2 = rd[b2];
-					for (auto i: cur) if (in2.find(i) == in2.end()) {
-						change = true;
-						in2.insert(i);
-					}
+		}
+		if (live) for (int o = 0; o < 2; ++o) if (i->isrightvalue(o)) {
+			switch(i->oper[o]) {
+			case Operand::LOCAL:
+				in.set(i->oper[o].var->id);
+				break;
+			case Operand::REG: {
+				Instruction *reg = i->oper[o].reg;
+				if (!lvreg[reg->id]) {
+					lvreg[reg->id] = 1;
+					/* Already walked past, unless defined earlier in this block */
+					if (block_of[reg->id] != b || reg->id > i->id)
+						solver->push(block_of[reg->id]);
 				}
+				break;
+			}
 			}
 		}
-	} while (change);
+	}
+}
+
+}
+
+void Function::constant_propagate()
+{
+	int propa_count = 0;
+	ReachingDefs rd;
+	rd.init(this);
+	const std::vector<int> &def_bit = rd.def_bit;
+
+	DataflowSolver<ReachingDefs> solver(this, rd);
+	solver.solve();
+
+	bool change;
 	do {
 		change = false;
 		for (Block *b: blocks) {
-			iset cur = rd[b]; // Copy
+			BitVector cur = solver.in[b->id]; // Copy
 			for (Instruction *i: b->instr) {
 				for (int o = 0; o < 2; ++o) if (i->isrightvalue(o)) switch(i->oper[o].type) {
 				case Operand::LOCAL: {
 					Localvar *var = i->oper[o].var;
-					auto vst = cur.lower_bound(std::make_pair(var, 0));
-					auto ved = cur.lower_bound(std::make_pair(var, UINTPTR_MAX));
-					bool flag = true;
+					bool flag = true, first = true;
 					long long value = 0;
-					for (auto v = vst; v != ved; ++v) {
-						Instruction *ins2 = (Instruction *)v->second;
+					cur.each(rd.of_var[var->id], [&](size_t d) {
+						Instruction *ins2 = rd.def[d];
 						assert(ins2->op == Opcode::MOVE || ins2->op == Opcode::ENTER);
+						if (!flag)
+							return;
 						if (ins2->op == Opcode::MOVE && ins2->oper[0].type == Operand::CONST) {
-							if (v == vst) {
+							if (first) {
 								value = ins2->oper[0].value_const;
 							} else if (value != ins2->oper[0].value_const) {
 								flag = false;
@@ -843,9 +977,8 @@ void Function::constant_propagate()
 						} else {
 							flag = false;
 						}
-						if (!flag)
-							break;
-					}
+						first = false;
+					});
 					if (flag) {
 						i->oper[o].to_const(value);
 						change = true;
@@ -862,95 +995,48 @@ void Function::constant_propagate()
 					}
 				}
 				}
-				if (i->op == Opcode::MOVE && i->oper[1] == Operand::LOCAL) {
-					Localvar *def = i->oper[1].var;
-					auto vst = cur.lower_bound(std::make_pair(def, 0));
-					auto ved = cur.lower_bound(std::make_pair(def, UINTPTR_MAX));
-					cur.erase(vst, ved);
-					cur.insert(std::make_pair(def, (uintptr_t)i));
+				if (def_bit[i->id] != -1) {
+					cur.subtract(rd.of_var[i->oper[1].var->id]);
+					cur.set(def_bit[i->id]);
 				}
 			}
 		}
 	} while(change);
-	if (output_report) {
-		printf("Function: %d\n", name);
-		printf("Number of constants propagated: %d\n", propa_count);
+	if (prog->output_report) {
+		report(std_out, "Function: %d\n", name);
+		report(std_out, "Number of constants propagated: %d\n", propa_count);
 	}
 }
 
 void Function::dead_eliminate()
 {
-	typedef std::set<Localvar*> iset; // Set of variable definitions
 	int elimin_count_in = 0, elimin_count_out = 0;
-	std::map<Block*, iset> lv; // Live Variables OUT
-	std::set<Instruction*> lvreg; // Live Temporary Registers
-	std::set<Block*> inloop; // Block in Loops
-	for (Block *b: blocks) {
-		lv[b] = iset();
-	}
-	for (auto s: loops) for (Block *b: s.second) {
-		inloop.insert(b);
-	}
-	bool change;
-	do {
-		change = false;
-		for (auto ib = blocks.rbegin(); ib != blocks.rend(); ++ib) {
-			Block *b = *ib;
-			iset cur = lv[b]; // Copy
-			for (auto j = b->instr.rbegin(); j != b->instr.rend(); ++j) {
-				Instruction *i = *j;
-				bool live = false;
-				if (!i->eliminable() || lvreg.find(i) != lvreg.end()) {
-					live = true;
-				}
-				if (i->op == Opcode::MOVE && i->oper[1] == Operand::LOCAL) {
-					Localvar *def = i->oper[1].var;
-					if (cur.find(def) != cur.end()) {
-						cur.erase(def);
-						live = true;
-					}
-				}
-				if (live) for (int o = 0; o < 2; ++o) if (i->isrightvalue(o)) {
-					switch(i->oper[o]) {
-					case Operand::LOCAL: {
-						Localvar *use = i->oper[o].var;
-						cur.insert(use);
-						break;
-					}
-					case Operand::REG: {
-						Instruction *reg = i->oper[o].reg;
-						if (lvreg.find(reg) == lvreg.end()) {
-							lvreg.insert(reg);
-							change = true;
-						}
-						break;
-					}
-					}
-				}
-			}
-			for (Block *b2: b->prevs) {
-				iset &out2 = lv[b2];
-				for (auto i: cur) if (out2.find(i) == out2.end()) {
-					change = true;
-					out2.insert(i);
-				}
-			}
-		}
-	} while (change);
+
+	Liveness lv;
+	DataflowSolver<Liveness> solver(this, lv);
+	lv.func = this;
+	lv.solver = &solver;
+	lv.lvreg.assign(instrs.size(), 0);
+	lv.block_of.resize(instrs.size());
+	for (Block *b: blocks)
+		for (Instruction *i: b->instr)
+			lv.block_of[i->id] = b->id;
+	solver.solve();
+
 	for (auto ib = blocks.rbegin(); ib != blocks.rend(); ++ib) {
 		Block *b = *ib;
-		iset cur = lv[b]; // Copy
-		bool inl = (inloop.find(b) != inloop.end());
+		BitVector cur = solver.out[b->id]; // Copy
+		bool inl = loop_of[b->id] != -1;
 		for (auto j = b->instr.rbegin(); j != b->instr.rend(); ++j) {
 			Instruction *i = *j;
 			bool live = false;
-			if (!i->eliminable() || lvreg.find(i) != lvreg.end()) {
+			if (!i->eliminable() || lv.lvreg[i->id]) {
 				live = true;
 			}
 			if (i->op == Opcode::MOVE && i->oper[1] == Operand::LOCAL) {
-				Localvar *def = i->oper[1].var;
-				if (cur.find(def) != cur.end()) {
-					cur.erase(def);
+				int def = i->oper[1].var->id;
+				if (cur.test(def)) {
+					cur.reset(def);
 					live = true;
 				}
 			}
@@ -958,18 +1044,14 @@ void Function::dead_eliminate()
 				for (int o = 0; o < 2; ++o) if (i->isrightvalue(o)) {
 					switch(i->oper[o]) {
 					case Operand::LOCAL: {
-						Localvar *use = i->oper[o].var;
-						cur.insert(use);
+						cur.set(i->oper[o].var->id);
 						break;
 					}
 					}
 				}
 			} else {
 				/* Eliminate */
-				int name = i->name;
-				*i = Instruction();
-				i->op.type = Opcode::NOP;
-				i->name = name;
+				i->erase();
 				if (inl)
 					++elimin_count_in;
 				else
@@ -977,14 +1059,28 @@ void Function::dead_eliminate()
 			}
 		}
 	}
-	if (output_report) {
-		fprintf(stderr, "Function: %d\n", name);
-		fprintf(stderr, "Number of statements eliminated in SCR: %d\n", elimin_count_in);
-		fprintf(stderr, "Number of statements eliminated not in SCR: %d\n", elimin_count_out);
+	if (prog->output_report) {
+		report(std_err, "Function: %d\n", name);
+		report(std_err, "Number of statements eliminated in SCR: %d\n", elimin_count_in);
+		report(std_err, "Number of statements eliminated not in SCR: %d\n", elimin_count_out);
 	}
 }
 
-Block::~Block() {
-    for (auto iter : instr)
-        delete iter;
+void Function::compact()
+{
+	for (Block *b: blocks)
+		b->compact();
+	index();
+}
+
+/* Drop NOP tombstones; a block that is all tombstones keeps its last one */
+void Block::compact()
+{
+	Instruction *tail = instr.back();
+	auto last = std::remove_if(instr.begin(), instr.end(),
+		[](Instruction *i) { return i->op == Opcode::NOP; });
+	if (last == instr.begin())
+		instr.assign(1, tail);
+	else
+		instr.erase(last, instr.end());
 }
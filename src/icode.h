@@ -1,23 +1,29 @@
+#ifndef ICODE_H
+#define ICODE_H
 
 #include <cassert>
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <list>
-#include <stack>
 #include <map>
 #include <set>
 #include <unordered_set>
 #include <unordered_map>
 
-extern bool output_report;
+#include "arena.h"
 
 struct Instruction;
 struct Block;
 struct Function;
 struct Localvar;
+struct Source;
+struct BinaryReader;
+class ThreadPool;
+class Output;
 
 struct Opcode {
-	enum Type {
+	enum Type : uint8_t {
 		UNKNOWN = 0,
 		ADD, SUB, MUL, DIV, MOD, NEG, CMPEQ, CMPLE, CMPLT,
 		NOP,
@@ -30,25 +36,80 @@ struct Opcode {
 		ENTRYPC,
 		OPCODE_MAX,
 	};
-	static const char *const opname[OPCODE_MAX];
-	static const int operand_count[OPCODE_MAX];
+
+	struct Traits {
+		const char *name;
+		int operands;		/* -1 for UNKNOWN */
+		bool rvalue[2];		/* operand is read, not written or jumped to */
+		bool eliminable;	/* only effect is its own result */
+		int fold;		/* leading operands that must be CONST to fold, 0 if never */
+	};
+	static constexpr Traits traits[OPCODE_MAX] = {
+		[UNKNOWN]={ "unknown", -1, { false, false }, false, 0 },
+		[ADD]=    { "add",      2, { true,  true  }, true,  2 },
+		[SUB]=    { "sub",      2, { true,  true  }, true,  2 },
+		[MUL]=    { "mul",      2, { true,  true  }, true,  2 },
+		[DIV]=    { "div",      2, { true,  true  }, true,  2 },
+		[MOD]=    { "mod",      2, { true,  true  }, true,  2 },
+		[NEG]=    { "neg",      1, { true,  false }, true,  1 },
+		[CMPEQ]=  { "cmpeq",    2, { true,  true  }, true,  2 },
+		[CMPLE]=  { "cmple",    2, { true,  true  }, true,  2 },
+		[CMPLT]=  { "cmplt",    2, { true,  true  }, true,  2 },
+		[NOP]=    { "nop",      0, { false, false }, false, 0 },
+		[BR]=     { "br",       1, { false, false }, false, 0 },
+		[BLBC]=   { "blbc",     2, { true,  false }, false, 0 },
+		[BLBS]=   { "blbs",     2, { true,  false }, false, 0 },
+		[CALL]=   { "call",     1, { false, false }, false, 0 },
+		[LOAD]=   { "load",     1, { true,  false }, true,  0 },
+		[STORE]=  { "store",    2, { true,  true  }, false, 0 },
+		[MOVE]=   { "move",     2, { true,  false }, true,  1 },
+		[READ]=   { "read",     0, { false, false }, false, 0 },
+		[WRITE]=  { "write",    1, { true,  false }, false, 0 },
+		[WRL]=    { "wrl",      0, { false, false }, false, 0 },
+		[PARAM]=  { "param",    1, { true,  false }, false, 0 },
+		[ENTER]=  { "enter",    1, { false, false }, false, 0 },
+		[RET]=    { "ret",      1, { false, false }, false, 0 },
+		[ENTRYPC]={ "entrypc",  0, { false, false }, false, 0 },
+	};
 
 	Type type;
 
 	Opcode (): type(UNKNOWN) {}
 	Opcode (const char *name);
+	Opcode (const char *name, size_t len);
 	operator Type() const { return type; }
 
-	const char *name() const { return opname[type]; }
-	int operands() const { return operand_count[type]; }
+	const Traits &traits_of() const { return traits[type]; }
+	const char *name() const { return traits[type].name; }
+	int operands() const { return traits[type].operands; }
 };
 
+/*
+ * Operand tags and variable names, interned once per Program so operands
+ * and variables carry a 32-bit id.  Id 0 is the empty string: a zero tag
+ * means the operand has none.
+ */
+class Names {
+public:
+	Names ();
+	uint32_t intern (const char *str, size_t len);
+	const std::string &operator[] (uint32_t id) const { return strings[id]; }
+	size_t size () const { return strings.size(); }
+
+private:
+	std::vector<std::string> strings;
+	std::unordered_map<std::string, uint32_t> ids;
+};
 
+/* 16 bytes: kind and tag id share a word, then the SSA index and payload */
 struct Operand {
-	enum Type {
+	enum Type : uint8_t {
 		UNKNOWN = 0, GP, FP, CONST, LOCAL, REG, LABEL, FUNC
 	};
-	Type type;
+	Type type : 8;
+	uint32_t tag : 24;
+        // SSA
+        int ssa_idx;
 	union {
 		long long _value;
 		long long value_const;
@@ -56,15 +117,12 @@ struct Operand {
 		Block *jump;
 		Localvar *var;
 	};
-	std::string tag;
-	Operand (): type(UNKNOWN), _value(0), tag() {}
-	Operand (const char *str);
+	Operand (): type(UNKNOWN), tag(0), ssa_idx(-1), _value(0) {}
+	Operand (const char *str, Names &names);
+	Operand (const char *str, size_t len, Names &names);
 	operator Type() const { return type; }
-	void icode (FILE *out) const;
-	void ccode (FILE *out) const;
-
-        // SSA
-        int ssa_idx = -1;
+	void icode (Output &out, const Names &names) const;
+	void ccode (Output &out) const;
 
         bool is_local() const { return type == LOCAL; }
         bool is_const() const { return type == CONST; }
@@ -75,12 +133,13 @@ struct Operand {
 
 struct Instruction {
 	int name = -1;
+	int id = -1;		/* dense index in Function::instrs */
 	Opcode op;
 	Operand oper[2];
 	Instruction () {}
-	Instruction (FILE *in);
-	void icode (FILE *out) const;
-	void ccode (FILE *out) const;
+	Instruction (FILE *in, Names &names);
+	void icode (Output &out, const Names &names) const;
+	void ccode (Output &out) const;
 	operator bool() const { return bool(op); }
         int get_branch_oper () const;
         Block *get_branch_target () const;
@@ -88,8 +147,8 @@ struct Instruction {
         void set_branch(Block *block);
 	bool isconst() const;
 	long long constvalue() const;
-	bool isrightvalue(int o) const;
-	bool eliminable() const;
+	bool isrightvalue(int o) const { return o >= 0 && o < 2 && op.traits_of().rvalue[o]; }
+	bool eliminable() const { return op.traits_of().eliminable; }
 
         void erase();
         bool is_move() const { return op == Opcode::MOVE; }
@@ -99,6 +158,7 @@ class Function;
 class Program;
 
 struct Phi {
+    Localvar* var = nullptr;
     int name = 0;
     int l;
     std::vector<Operand> r;
@@ -108,38 +168,60 @@ struct Phi {
     void clear() { r.clear(); pre.clear(); }
     long long value() const { return r[0].value_const; }
     bool is_const() const;
-    void icode(FILE* out, Localvar* var) const;
+    void icode(Output& out, const Names& names) const;
     bool empty() const { return r.empty(); }
 };
 
-struct RenameStack {
-    int cnt;
-    std::stack<int> stack;
+// One use of an SSA value: operand o of in, or with in NULL operand o
+// of the phi'th phi of block
+struct Use {
+    Block* block;
+    Instruction* in;
+    int phi;
+    int o;
+};
+
+// Orders variables by frame offset, so per-variable maps iterate the
+// same way whatever addresses the allocator handed out
+struct VarLess {
+    bool operator() (const Localvar* a, const Localvar* b) const;
+};
 
-    RenameStack() : cnt(0) { stack.push(0); }
-    int push() { stack.push(++cnt); return cnt; }
-    int pop() { int r = stack.top(); stack.pop(); return r; }
-    int top() { return stack.top(); }
+// Slice of one of Function's CSR arrays, iterated as block ids
+struct IdRange {
+    const int* first;
+    const int* last;
+    const int* begin() const { return first; }
+    const int* end() const { return last; }
+    int size() const { return last - first; }
 };
 
 class Block {
 public:
     Block(Function* func, std::vector<Instruction*>::iterator begin, std::vector<Instruction*>::iterator end)
         : func(func), instr(begin, end), name((*begin)->name) {}
-    ~Block();
 
     Function* func;
     int name;
+    int id = -1;            // index in Function::blocks
     Block* seq_next = nullptr;
     Block* br_next = nullptr;
     Block* order_next = nullptr;
-    std::list<Instruction*> instr;
+    // Erased instructions stay in place as NOP tombstones until compact()
+    std::vector<Instruction*> instr;
     std::vector<Block*> prevs;
     std::vector<Block*> prevs2;
     Block *idom = NULL;
     std::list<Block*> domc;
 
-    std::vector<Instruction*> insert;
+    // Preorder and postorder numbers and depth in the dominator tree,
+    // from Function::number_domtree(); -1 outside the tree.  The
+    // incremental updates keep dom_depth current but not the numbers.
+    int dom_pre = -1, dom_post = -1, dom_depth = -1;
+    bool dominates(const Block* b) const {
+        return dom_pre >= 0 && dom_pre <= b->dom_pre && b->dom_post <= dom_post;
+    }
+    bool strictly_dominates(const Block* b) const { return b != this && dominates(b); }
 
     long long addr() const {
 	/* TODO */
@@ -148,31 +230,53 @@ public:
 
     // SSA
     std::vector<Block*> df;
-    std::unordered_set<Localvar*> defs;
-    std::unordered_map<Localvar*, Phi> phi;
+    std::vector<Phi> phi;  // sorted by VarLess
     long long ssa_addr = 0;
 
-    void compute_df();
-    void find_defs();
-    void ssa_rename_var(std::map<Localvar*, RenameStack>& stack);
-
     void append(Instruction* in);
+    void compact();
 };
 
 struct Localvar {
-	std::string name;
+	uint32_t name;		/* in Program::names */
+	int id = -1;		/* index in Function::localvars */
 	long long offset;
 	Localvar () {}
-	Localvar (std::string n, long long o): name(n), offset(o) {}
+	Localvar (uint32_t n, long long o): name(n), offset(o) {}
+};
+
+inline bool VarLess::operator() (const Localvar* a, const Localvar* b) const
+{
+    return a->offset < b->offset;
+}
+
+/*
+ * A loop of the function's nesting forest.  Blocks and loops are named
+ * by id.  The loop's blocks, those of nested loops included, are
+ * Function::loop_blocks[begin..end), header first.
+ */
+struct Loop {
+	int header;
+	int parent = -1;		/* enclosing loop, -1 at top level */
+	int depth = 1;
+	bool irreducible = false;	/* also entered other than through header */
+	int preheader = -1;		/* sole outside predecessor, falling only into header */
+	int begin = 0, end = 0;
+	std::vector<int> children;
+	std::vector<int> latches;	/* predecessors of header inside the loop */
+	std::vector<int> exits;		/* blocks outside reached from inside */
 };
 
 class Function {
 public:
     Function(Program* parent, std::vector<Instruction>::iterator begin, std::vector<Instruction>::iterator end);
-    ~Function();
+    Function(Program* parent, BinaryReader& in);
     int rename (int i);
-    int icode (FILE *out) const;
-    void ccode (FILE *out) const;
+    int icode (Output &out) const;
+    void ccode (Output &out) const;
+
+    // Owns the blocks, instructions and variables below
+    Arena arena;
 
     Program* prog;
     int name;
@@ -181,33 +285,151 @@ public:
     bool is_main;
     std::vector<Localvar*> localvars;
     std::vector<Block*> blocks;
-    std::map<Block*, std::set<Block*> > loops;
     Block* entry;
 
+    // Dense numbering from index(): blocks[b->id] == b, instrs[in->id] == in
+    // and localvars[v->id] == v.  Edges are kept again in CSR form, the
+    // successors of block i being succ_list[succ_start[i]..succ_start[i+1]).
+    // rpo and po hold the blocks reachable from entry.
+    std::vector<Instruction*> instrs;
+    std::vector<int> succ_start, succ_list;
+    std::vector<int> pred_start, pred_list;
+    std::vector<int> rpo, po;
+    void index();
+    IdRange succs(int id) const { return IdRange{succ_list.data() + succ_start[id], succ_list.data() + succ_start[id + 1]}; }
+    IdRange preds(int id) const { return IdRange{pred_list.data() + pred_start[id], pred_list.data() + pred_start[id + 1]}; }
+
+    // A new block on the edge from -> to, and a new slot in the frame
+    Block* split_edge(Block* from, Block* to);
+    Localvar* add_local(uint32_t name);
+
     void build_domtree();
+    std::vector<int> compute_idoms() const;
+    void number_domtree();
+    bool dominates(int a, int b) const { return blocks[a]->dominates(blocks[b]); }
+
+    // Incremental dominator tree updates after a CFG edit, in domtree.cpp.
+    // Call them once the edges and prevs are rewired; number_domtree()
+    // afterwards before asking dominates().
+    void dom_insert_edge(Block* from, Block* to);
+    void dom_delete_edge(Block* from, Block* to);
+    void dom_split_block(Block* top, Block* bottom);
+    void dom_insert_preheader(Block* pre, Block* header);
+    void dom_verify();
+
+    // Loop nesting forest, in loops.cpp.  Inner loops come before the
+    // loops enclosing them, so walking loops in order is innermost first.
+    // loop_of[id] is a block's innermost loop, -1 outside every loop.
+    std::vector<Loop> loops;
+    std::vector<int> loop_of;
+    std::vector<int> loop_blocks, loop_pos;  // loop_blocks[loop_pos[id]] == id
+    bool in_loop(int loop, int block) const {
+        int p = loop_pos[block];
+        return p >= loops[loop].begin && p < loops[loop].end;
+    }
+    void build_loops();
+    void finish_loops();
     void constant_propagate();
     void dead_eliminate();
+    void aggressive_dead_eliminate();
+    void partial_redundancy();
+    void simplify_cfg();
+    void compact();
+
+    // Report lines are kept per function and printed by the Program in
+    // function order, so passes may run on several threads
+    std::vector<std::pair<Output*, std::string> > reports;
+    void report(Output& stream, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
 
     // SSA
     std::unordered_map<int, std::string> offset2tag;
+    void ssa_prepare();
+    void compute_df();
     void place_phi();
+    void ssa_rename();
     void remove_phi();
     void ssa_constant_propagate();
+    void ssa_sccp();
+    void ssa_gvn();
     void ssa_licm();
+    void ssa_copy_propagate();
+    void ssa_dead_eliminate();
+    void ssa_aggressive_dead_eliminate();
+    void ssa_to_3addr();
+    std::vector<int> ssa_versions;  // Last version handed out, by variable id
+
+    // SSA values, numbered by ssa_index(): the result of in is value
+    // in->id, version k of variable v is value ssa_value_base[v] + k.
+    // Use lists hold every operand read, phi operands included, and
+    // replace_all_uses() keeps them current.  Anything that renumbers
+    // instructions or adds phis calls ssa_index() again.
+    std::vector<int> ssa_value_base;
+    std::vector<Block*> value_block;  // Defining block, by value
+    std::vector<std::vector<Use> > value_uses;
+    void ssa_index();
+    int value_of(const Operand& o) const {
+        if (o.type == Operand::REG) return o.reg->id;
+        if (o.type == Operand::LOCAL && o.ssa_idx >= 0) return ssa_value_base[o.var->id] + o.ssa_idx;
+        return -1;
+    }
+    Operand& use_operand(const Use& u) { return u.in ? u.in->oper[u.o] : u.block->phi[u.phi].r[u.o]; }
+    void replace_all_uses(int value, const Operand& with);
+
+    // Incremental SSA repair, in ssaupdate.cpp.  Report the definitions
+    // and edges a pass added or removed, the new definitions already in
+    // their blocks and the edges already wired, then call ssa_update()
+    // with index() and the dominator tree current.
+    void ssa_add_def(Block* b, Instruction* in);
+    void ssa_add_edge(Block* from, Block* to);
+    void ssa_remove_edge(Block* from, Block* to);
+    void ssa_update();
+    std::vector<std::pair<Block*, Instruction*> > ssa_new_defs;
+    std::vector<std::pair<Block*, Block*> > ssa_new_edges, ssa_dead_edges;
 };
 
+// Which phis Function::place_phi keeps, -ssa= on the command line
+enum SsaForm {
+	MINIMAL_SSA,		/* the whole iterated dominance frontier */
+	SEMI_PRUNED_SSA,	/* only variables live into some block */
+	PRUNED_SSA,		/* only where the variable is live */
+	MAX_SSA_FORM,
+};
+extern const char *ssaformname[];
+
 struct Program {
         std::vector<Function*> funcs;
 	Function *main = NULL;
+	Names names;
         Program () {}
 	Program (FILE *in);
+	Program (const Source &src);
         ~Program ();
-	void rename ();
-	void icode (FILE *out);
-	void ccode (FILE *out);
+	bool output_report = false;
+	bool verify = false;	/* check incremental updates against rebuilds */
+	uint32_t pre_temp = 0;	/* name of the locals partial_redundancy() adds */
+	SsaForm ssa_form = MINIMAL_SSA;
+	ThreadPool *pool = NULL;
+	void set_jobs (int jobs);
+	void each_function (void (Function::*pass)());
+	void flush_reports ();
+	void split_functions (std::vector<Instruction> &instr);
+	int rename (int i = 2);
+	void icode (Output &out);
+	void icode_head (Output &out);
+	int icode (Output &out, Function *func);
+	void icode_tail (Output &out, int i);
+	void ccode (Output &out);
+	void ccode_head (Output &out, int main_name);
+	void ccode_tail (Output &out);
+	void binary (Output &out);
+	void read_binary (const Source &src);
 	void build_domtree();
 	void constant_propagate();
 	void dead_eliminate();
+	void aggressive_dead_eliminate();
+	void partial_redundancy();
+	void simplify_cfg();
+	void compact();
 
         // SSA
         int instr_cnt = 0;
@@ -221,9 +443,16 @@ struct Program {
         void ssa_rename_var();
         void ssa_licm();
         void ssa_constant_propagate();
+        void ssa_sccp();
+        void ssa_gvn();
+        void ssa_copy_propagate();
+        void ssa_dead_eliminate();
+        void ssa_aggressive_dead_eliminate();
         void ssa_to_3addr();
 
-        void ssa_icode(FILE* out);
+        void ssa_icode(Output& out);
 
-        static bool ssa_mode;
+        bool ssa_mode = false;
 };
+
+#endif
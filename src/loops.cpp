@@ -0,0 +1,190 @@
+#include <utility>
+#include <vector>
+
+#include "icode.h"
+
+/*
+ * Loop nesting forest by Havlak, "Nesting of Reducible and Irreducible
+ * Loops", with the fix from Ramalingam's "Identifying Loops in Almost
+ * Linear Time".  Blocks are visited in reverse DFS preorder; each one
+ * with back edges into it collapses the blocks that reach those edges
+ * without leaving its DFS subtree into a loop, union-find standing each
+ * inner loop in for all its blocks.  A path that enters from outside
+ * the subtree marks the loop irreducible.  Needs a current index().
+ */
+void Function::build_loops()
+{
+	int nb = blocks.size();
+	std::vector<int> number(nb, -1); // DFS preorder number, by block id
+	std::vector<int> node, last; // Block id and last descendant, by number
+	std::vector<std::pair<int, const int*> > dfs;
+	number[entry->id] = 0;
+	node.push_back(entry->id);
+	last.push_back(0);
+	dfs.push_back(std::make_pair(entry->id, succs(entry->id).begin()));
+	while (!dfs.empty()) {
+		int b = dfs.back().first;
+		const int *&next = dfs.back().second;
+		if (next != succs(b).end()) {
+			int s = *next++;
+			if (number[s] == -1) {
+				number[s] = node.size();
+				node.push_back(s);
+				last.push_back(0);
+				dfs.push_back(std::make_pair(s, succs(s).begin()));
+			}
+		} else {
+			last[number[b]] = node.size() - 1;
+			dfs.pop_back();
+		}
+	}
+
+	int n = node.size();
+	auto ancestor = [&](int w, int v) { return w <= v && v <= last[w]; };
+	std::vector<std::vector<int> > back(n), nonback(n);
+	for (int w = 0; w < n; ++w)
+		for (int p: preds(node[w])) if (number[p] != -1)
+			(ancestor(w, number[p]) ? back : nonback)[w].push_back(number[p]);
+
+	std::vector<int> uf(n), loop_at(n, -1), inpool(n, -1);
+	for (int w = 0; w < n; ++w)
+		uf[w] = w;
+	auto find = [&](int x) {
+		int r = x;
+		while (uf[r] != r)
+			r = uf[r];
+		while (uf[x] != r) {
+			int up = uf[x];
+			uf[x] = r;
+			x = up;
+		}
+		return r;
+	};
+
+	loops.clear();
+	loop_of.assign(nb, -1);
+	std::vector<int> pool, work;
+	for (int w = n - 1; w >= 0; --w) {
+		pool.clear();
+		bool self = false, irreducible = false;
+		for (int v: back[w]) {
+			if (v == w) {
+				self = true;
+				continue;
+			}
+			int x = find(v);
+			if (inpool[x] != w) {
+				inpool[x] = w;
+				pool.push_back(x);
+			}
+		}
+		work = pool;
+		while (!work.empty()) {
+			int x = work.back();
+			work.pop_back();
+			for (int y: nonback[x]) {
+				int z = find(y);
+				if (!ancestor(w, z)) {
+					irreducible = true;
+					nonback[w].push_back(z);
+				} else if (z != w && inpool[z] != w) {
+					inpool[z] = w;
+					pool.push_back(z);
+					work.push_back(z);
+				}
+			}
+		}
+		if (pool.empty() && !self)
+			continue;
+
+		int l = loops.size();
+		loops.push_back(Loop());
+		loops[l].header = node[w];
+		loops[l].irreducible = irreducible;
+		loop_at[w] = l;
+		loop_of[node[w]] = l;
+		for (int x: pool) {
+			uf[x] = w;
+			if (loop_at[x] != -1)
+				loops[loop_at[x]].parent = l;
+			else
+				loop_of[node[x]] = l;
+		}
+	}
+
+	finish_loops();
+}
+
+/*
+ * Everything else in the forest follows from loop_of and the parents:
+ * children, depths, the block ranges, and from the CFG the latches,
+ * exits and preheaders.  Passes that add blocks set their loop_of and
+ * rerun this after index() instead of building the loops again.
+ */
+void Function::finish_loops()
+{
+	int nb = blocks.size(), nl = loops.size();
+	loop_of.resize(nb, -1);
+	for (Loop &l: loops)
+		l.children.clear();
+	for (int l = nl - 1; l >= 0; --l) {
+		int p = loops[l].parent;
+		loops[l].depth = p == -1 ? 1 : loops[p].depth + 1;
+		if (p != -1)
+			loops[p].children.push_back(l);
+	}
+
+	/* Each loop's own blocks, then its children's ranges, outermost first */
+	std::vector<std::vector<int> > own(nl);
+	for (int b = 0; b < nb; ++b) if (loop_of[b] != -1 && loops[loop_of[b]].header != b)
+		own[loop_of[b]].push_back(b);
+	loop_blocks.clear();
+	loop_pos.assign(nb, -1);
+	std::vector<std::pair<int, size_t> > stack;
+	for (int root = nl - 1; root >= 0; --root) if (loops[root].parent == -1) {
+		stack.push_back(std::make_pair(root, 0));
+		while (!stack.empty()) {
+			int l = stack.back().first;
+			size_t next = stack.back().second++;
+			if (next == 0) {
+				loops[l].begin = loop_blocks.size();
+				loop_pos[loops[l].header] = loop_blocks.size();
+				loop_blocks.push_back(loops[l].header);
+				for (int b: own[l]) {
+					loop_pos[b] = loop_blocks.size();
+					loop_blocks.push_back(b);
+				}
+			}
+			if (next < loops[l].children.size()) {
+				stack.push_back(std::make_pair(loops[l].children[next], 0));
+			} else {
+				loops[l].end = loop_blocks.size();
+				stack.pop_back();
+			}
+		}
+	}
+
+	std::vector<int> seen(nb, -1);
+	for (int l = 0; l < nl; ++l) {
+		Loop &loop = loops[l];
+		loop.latches.clear();
+		loop.exits.clear();
+		loop.preheader = -1;
+		int outside = 0, pre = -1;
+		for (int p: preds(loop.header)) {
+			if (in_loop(l, p)) {
+				loop.latches.push_back(p);
+			} else {
+				++outside;
+				pre = p;
+			}
+		}
+		if (!loop.irreducible && outside == 1 && succs(pre).size() == 1)
+			loop.preheader = pre;
+		for (int i = loop.begin; i < loop.end; ++i)
+			for (int s: succs(loop_blocks[i])) if (!in_loop(l, s) && seen[s] != l) {
+				seen[s] = l;
+				loop.exits.push_back(s);
+			}
+	}
+}
@@ -1,14 +1,25 @@
+#include <cassert>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <vector>
+#include <algorithm>
 
 #include "icode.h"
+#include "output.h"
+#include "parse.h"
 
 enum Opt {
 	SCP, //simple constant propagation
 	DSE, //dead statement elimination
         LICM, // loop invariant code motion
         SSA,
+	SCCP, // sparse conditional constant propagation, on SSA
+	GVN, // global value numbering, on SSA
+	PRE, // partial redundancy elimination, not on SSA
+	COPYPROP, // copy propagation, on SSA
+	ADCE, // aggressive dead code elimination
+	SIMPLIFYCFG, // CFG cleanup
 	MAX_OPT,
 };
 
@@ -17,6 +28,12 @@ const char *optname[] = {
 	[DSE] = "dse",
         [LICM] = "licm",
         [SSA] = "ssa",
+	[SCCP] = "sccp",
+	[GVN] = "gvn",
+	[PRE] = "pre",
+	[COPYPROP] = "copyprop",
+	[ADCE] = "adce",
+	[SIMPLIFYCFG] = "simplifycfg",
 };
 
 enum Backend {
@@ -26,6 +43,7 @@ enum Backend {
 	REP,
 	DOM,
         SSA_3ADDR,
+	BIN,
 	MAX_BACKEND,
 };
 
@@ -36,69 +54,234 @@ const char *backendname[] = {
 	[REP] = "rep",
 	[DOM] = "dom",
         [SSA_3ADDR] = "ssa,3addr",
+	[BIN] = "bin",
 };
 
-void print_cfg(Program *prog) {
+enum Input {
+	TEXT,
+	BINARY,
+	MAX_INPUT,
+};
+
+const char *inputname[] = {
+	[TEXT] = "3addr",
+	[BINARY] = "bin",
+};
+
+void print_cfg(Program *prog, Output &out) {
 	for (Function *func: prog->funcs) {
-		printf("Function: %d\n", func->name);
+		out << "Function: " << func->name << '\n';
 
-		printf("Basic blocks:");
+		out << "Basic blocks:";
 		for (Block *b = func->entry; b != NULL; b = b->order_next)
-			printf(" %d", b->name);
+			out << ' ' << b->name;
 
-		printf("\nCFG:\n");
+		out << "\nCFG:\n";
 		for (Block *b = func->entry; b != NULL; b = b->order_next) {
-			printf("%d ->", b->name);
+			out << b->name << " ->";
 			if (b->seq_next != nullptr)
-				printf(" %d", b->seq_next->name);
+				out << ' ' << b->seq_next->name;
 			if (b->br_next != nullptr)
-				printf(" %d", b->br_next->name);
-			putchar('\n');
+				out << ' ' << b->br_next->name;
+			out << '\n';
 		}
 	}
 }
 
-void print_dom(Program *prog) {
+void print_dom(Program *prog, Output &out) {
 	for (Function *func: prog->funcs) {
-		printf("Function: %d\n", func->name);
+		out << "Function: " << func->name << '\n';
 
-		printf("Basic blocks:");
+		out << "Basic blocks:";
 		for (Block *b = func->entry; b != NULL; b = b->order_next)
-			printf(" %d", b->name);
+			out << ' ' << b->name;
 
-		printf("\nCFG:\n");
+		out << "\nCFG:\n";
 		for (Block *b = func->entry; b != NULL; b = b->order_next) {
-			printf("%d ->", b->name);
+			out << b->name << " ->";
 			if (b->seq_next != nullptr)
-				printf(" %d", b->seq_next->name);
+				out << ' ' << b->seq_next->name;
 			if (b->br_next != nullptr)
-				printf(" %d", b->br_next->name);
-			putchar('\n');
+				out << ' ' << b->br_next->name;
+			out << '\n';
 		}
 
-		printf("\nDom Tree:\n");
+		out << "\nDom Tree:\n";
 		for (Block *b = func->entry; b != NULL; b = b->order_next) {
-			printf("%d ->", b->name);
+			out << b->name << " ->";
 			for (Block *c: b->domc)
-				printf(" %d", c->name);
-			putchar('\n');
+				out << ' ' << c->name;
+			out << '\n';
 		}
 
-		printf("\nLoops:\n");
-		for (Block *b = func->entry; b != NULL; b = b->order_next) if (func->loops.count(b) > 0) {
-			auto s = func->loops[b];
-			for (Block *c: s) {
-				printf(" %d", c->name);
+		out << "\nLoops:\n";
+		std::vector<int> layout(func->blocks.size());
+		int n = 0;
+		for (Block *b = func->entry; b != NULL; b = b->order_next)
+			layout[b->id] = n++;
+		for (Block *b = func->entry; b != NULL; b = b->order_next) {
+			int l = func->loop_of[b->id];
+			if (l == -1 || func->loops[l].header != b->id)
+				continue;
+			/* Loop ranges are in forest order, print them in layout order */
+			std::vector<int> s(func->loop_blocks.begin() + func->loops[l].begin,
+				func->loop_blocks.begin() + func->loops[l].end);
+			std::sort(s.begin(), s.end(), [&](int x, int y) { return layout[x] < layout[y]; });
+			for (int c: s) {
+				out << ' ' << func->blocks[c]->name;
 			}
-			putchar('\n');
+			out << '\n';
+		}
+	}
+}
+
+static void optimize(Program &prog, const std::vector<Opt> &opts, Backend b)
+{
+	prog.build_domtree();
+
+        bool ssa_on = false;
+
+	for (Opt o: opts) {
+		switch(o) {
+		case SCP:
+			if (ssa_on)
+				prog.ssa_constant_propagate();
+			else
+				prog.constant_propagate();
+			break;
+		case DSE:
+			if (ssa_on)
+				prog.ssa_dead_eliminate();
+			else
+				prog.dead_eliminate();
+			break;
+		case SSA:
+			prog.ssa_prepare();
+			ssa_on = true;
+			break;
+		case LICM:
+			if (ssa_on)
+				prog.ssa_licm();
+			break;
+		case SCCP:
+			if (ssa_on)
+				prog.ssa_sccp();
+			break;
+		case GVN:
+			if (ssa_on)
+				prog.ssa_gvn();
+			break;
+		case PRE:
+			if (!ssa_on)
+				prog.partial_redundancy();
+			break;
+		case COPYPROP:
+			if (ssa_on)
+				prog.ssa_copy_propagate();
+			break;
+		case ADCE:
+			if (ssa_on)
+				prog.ssa_aggressive_dead_eliminate();
+			else
+				prog.aggressive_dead_eliminate();
+			break;
+		case SIMPLIFYCFG:
+			prog.simplify_cfg();
+			break;
 		}
+		/* Squeeze out the NOPs the pass left behind */
+		prog.compact();
 	}
+
+        if (ssa_on && b != SSA_3ADDR)
+            prog.ssa_to_3addr();
 }
+
+/*
+ * Function-at-a-time pipeline: each function is parsed, optimized,
+ * renamed with the running instruction counter and emitted, then freed
+ * before the next one is read.  Output matches the batch path.  With
+ * -jobs the threads work inside the one function, on phi placement.
+ */
+static int stream(const Source &src, const std::vector<Opt> &opts, Backend b, int jobs, bool verify, SsaForm form)
+{
+	if (src.is_binary() || b == BIN) {
+		fprintf(stderr, "stream mode needs 3addr input and a text backend\n");
+		return 1;
+	}
+
+	Stream s(src);
+	Program prog;
+	prog.output_report = b == REP;
+	prog.verify = verify;
+	prog.ssa_form = form;
+	prog.set_jobs(jobs);
+	int i = 2, last = 0;
+	bool seen_main = false;
+
+	switch (b) {
+	case THREEADDR:
+	case SSA_3ADDR:
+		prog.icode_head(std_out);
+		break;
+	case C:
+		prog.ccode_head(std_out, s.main_name());
+		break;
+	}
+
+	while (s.next(prog)) {
+		Function *func = prog.funcs.back();
+		optimize(prog, opts, b);
+		i = prog.rename(i);
+
+		switch (b) {
+		case THREEADDR:
+		case SSA_3ADDR:
+			last = prog.icode(std_out, func);
+			break;
+		case C:
+			func->ccode(std_out);
+			break;
+		case CFG:
+			print_cfg(&prog, std_out);
+			break;
+		case DOM:
+			print_dom(&prog, std_out);
+			break;
+		}
+
+		if (prog.main == func) {
+			seen_main = true;
+			prog.main = NULL;
+		}
+		prog.funcs.clear();
+		delete func;
+	}
+	assert(seen_main);
+
+	switch (b) {
+	case THREEADDR:
+	case SSA_3ADDR:
+		prog.icode_tail(std_out, last);
+		break;
+	case C:
+		prog.ccode_tail(std_out);
+		break;
+	}
+	return 0;
+}
+
 int main(int argc, char **argv) {
 	std::vector<Opt> opts;
 	Backend b;
+	Input in = TEXT;
 	char *opt = NULL;
 	char *backend = NULL;
+	char *input = NULL;
+	bool streaming = false;
+	int jobs = 1;
+	bool verify = false;
+	SsaForm form = MINIMAL_SSA;
 	for (int i = 1; i < argc; ++i) {
 		char *equal = strchr(argv[i], '=');
 		if (equal == NULL) {
@@ -118,13 +301,44 @@ int main(int argc, char **argv) {
 				return 1;
 			}
 			backend = equal + 1;
+		} else if (length == 6 && strncmp(argv[i], "-input", 6) == 0) {
+			if (input != NULL) {
+				fprintf(stderr, "multiple input\n");
+				return 1;
+			}
+			input = equal + 1;
+		} else if (length == 5 && strncmp(argv[i], "-jobs", 5) == 0) {
+			jobs = atoi(equal + 1);
+			if (jobs < 1) {
+				fprintf(stderr, "bad jobs: %s\n", equal + 1);
+				return 1;
+			}
+		} else if (length == 4 && strncmp(argv[i], "-ssa", 4) == 0) {
+			int f;
+			for (f = 0; f < MAX_SSA_FORM; ++f)
+				if (strcmp(equal + 1, ssaformname[f]) == 0)
+					break;
+			if (f == MAX_SSA_FORM) {
+				fprintf(stderr, "unknown ssa form: %s\n", equal + 1);
+				return 1;
+			}
+			form = (SsaForm)f;
+		} else if (length == 7 && strncmp(argv[i], "-verify", 7) == 0) {
+			verify = atoi(equal + 1) != 0;
+		} else if (length == 5 && strncmp(argv[i], "-mode", 5) == 0) {
+			if (strcmp(equal + 1, "stream") == 0) {
+				streaming = true;
+			} else if (strcmp(equal + 1, "batch") != 0) {
+				fprintf(stderr, "unknown mode: %s\n", equal + 1);
+				return 1;
+			}
 		}
 	}
 	if (opt) {
 		char *s = opt;
 		char *dot;
 		do {
-			dot = strchr(opt, ',');
+			dot = strchr(s, ',');
 			if (dot) *dot = '\0';
 			int i;
 			for (i = 0; i < MAX_OPT; ++i) {
@@ -157,54 +371,56 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
-	if (b == REP) output_report = true;
-
-	Program prog(stdin);
-	prog.build_domtree();
+	if (input) {
+		int i;
+		for (i = 0; i < MAX_INPUT; ++i) {
+			if (strcmp(input, inputname[i]) == 0) {
+				in = (Input)i;
+				break;
+			}
+		}
+		if (i == MAX_INPUT) {
+			fprintf(stderr, "unknown input: %s\n", input);
+			return 1;
+		}
+	}
 
-        bool ssa_on = false;
 
-	for (Opt o: opts) switch(o) {
-	case SCP:
-                if (ssa_on) {
-                    prog.ssa_constant_propagate();
-                 } else
-                    prog.constant_propagate();
-		break;
-	case DSE:
-                if (!ssa_on)
-                    prog.dead_eliminate();
-		break;
-        case SSA:
-                prog.ssa_prepare();
-                ssa_on = true;
-                break;
-        case LICM:
-                if (ssa_on)
-                    prog.ssa_licm();
-                break;
+	Source src(fileno(stdin));
+	if ((in == BINARY) != src.is_binary()) {
+		fprintf(stderr, "input is not %s\n", inputname[in]);
+		return 1;
 	}
+	if (streaming)
+		return stream(src, opts, b, jobs, verify, form);
 
-        if (ssa_on && b != SSA_3ADDR)
-            prog.ssa_to_3addr();
+	Program prog(src);
+	prog.output_report = b == REP;
+	prog.verify = verify;
+	prog.ssa_form = form;
+	prog.set_jobs(jobs);
+	optimize(prog, opts, b);
 
 	prog.rename();
 	switch(b) {
 	case THREEADDR:
-		prog.icode(stdout);
+		prog.icode(std_out);
 		break;
 	case C:
-		prog.ccode(stdout);
+		prog.ccode(std_out);
 		break;
 	case CFG:
-		print_cfg(&prog);
+		print_cfg(&prog, std_out);
 		break;
 	case DOM:
-		print_dom(&prog);
+		print_dom(&prog, std_out);
 		break;
         case SSA_3ADDR:
-                prog.icode(stdout);
+                prog.icode(std_out);
                 break;
+	case BIN:
+		prog.binary(std_out);
+		break;
 	}
 
 	return 0;
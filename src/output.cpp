@@ -0,0 +1,73 @@
+#include <cerrno>
+#include <cstdio>
+#include <unistd.h>
+
+#include "output.h"
+
+Output std_out(1), std_err(2);
+
+Output::Output (int fd, size_t size):
+	fd(fd), buf(new char[size]), p(buf), end(buf + size)
+{
+}
+
+Output::~Output ()
+{
+	flush();
+	delete[] buf;
+}
+
+void Output::flush ()
+{
+	const char *s = buf;
+	while (s != p) {
+		ssize_t n = write(fd, s, p - s);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			break;
+		}
+		s += n;
+	}
+	p = buf;
+}
+
+Output &Output::put (const char *s, size_t n)
+{
+	if ((size_t)(end - p) < n) {
+		flush();
+		if ((size_t)(end - p) < n) {
+			/* Larger than the buffer: write it through */
+			while (n > 0) {
+				ssize_t w = write(fd, s, n);
+				if (w < 0) {
+					if (errno == EINTR)
+						continue;
+					perror("write");
+					break;
+				}
+				s += w;
+				n -= w;
+			}
+			return *this;
+		}
+	}
+	memcpy(p, s, n);
+	p += n;
+	return *this;
+}
+
+Output &Output::operator<< (long long v)
+{
+	char tmp[24], *q = tmp + sizeof tmp;
+	unsigned long long u = v < 0 ? 0ULL - (unsigned long long)v : v;
+
+	do {
+		*--q = '0' + u % 10;
+		u /= 10;
+	} while (u != 0);
+	if (v < 0)
+		*--q = '-';
+	return put(q, tmp + sizeof tmp - q);
+}
@@ -0,0 +1,44 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+/*
+ * Buffered sink for the emission backends.  Text is assembled in a large
+ * buffer with hand-rolled integer formatting and handed to the kernel
+ * with one write() per flush, so emitting an instruction costs no stdio
+ * locking or format parsing.
+ */
+class Output {
+public:
+	explicit Output (int fd, size_t size = 1 << 16);
+	~Output ();
+
+	void flush ();
+	Output &put (const char *s, size_t n);
+
+	Output &operator<< (char c) {
+		if (p == end)
+			flush();
+		*p++ = c;
+		return *this;
+	}
+	Output &operator<< (const char *s) { return put(s, strlen(s)); }
+	Output &operator<< (const std::string &s) { return put(s.data(), s.size()); }
+	Output &operator<< (int v) { return *this << (long long)v; }
+	Output &operator<< (long long v);
+
+private:
+	int fd;
+	char *buf, *p, *end;
+
+	Output (const Output &) = delete;
+	Output &operator= (const Output &) = delete;
+};
+
+/* Counterparts of stdout and stderr; flushed at exit */
+extern Output std_out, std_err;
+
+#endif
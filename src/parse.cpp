@@ -0,0 +1,325 @@
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+#include <cerrno>
+#include <utility>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "icode.h"
+#include "parse.h"
+
+Source::Source (int fd):
+	data(NULL), size(0), mapped(false)
+{
+	struct stat st;
+	bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+
+	if (regular && st.st_size > 0 && lseek(fd, 0, SEEK_CUR) == 0) {
+		void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			madvise(p, st.st_size, MADV_SEQUENTIAL);
+			data = (const char *)p;
+			size = st.st_size;
+			mapped = true;
+			return;
+		}
+	}
+
+	/* Pipe or terminal: one growing buffer, no per-line reads */
+	buf.resize(regular && st.st_size > 0 ? st.st_size + 1 : 1 << 16);
+	for (;;) {
+		if (size == buf.size())
+			buf.resize(buf.size() * 2);
+		ssize_t n = read(fd, &buf[size], buf.size() - size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			break;
+		}
+		if (n == 0)
+			break;
+		size += n;
+	}
+	data = buf.data();
+}
+
+Source::~Source ()
+{
+	if (mapped)
+		munmap((void *)data, size);
+}
+
+static inline bool is_space (char c)
+{
+	return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/* atoll() on a token that is not NUL-terminated */
+static long long parse_ll (const char *p, const char *end)
+{
+	bool neg = false;
+	long long v = 0;
+
+	if (p != end && (*p == '-' || *p == '+'))
+		neg = *p++ == '-';
+	for (; p != end && *p >= '0' && *p <= '9'; ++p)
+		v = v * 10 + (*p - '0');
+	return neg ? -v : v;
+}
+
+namespace {
+
+struct Scanner {
+	const char *p, *end;
+
+	Scanner (const char *begin, const char *end): p(begin), end(end) {}
+
+	/* Skip blanks, false at end of input */
+	bool skip () {
+		while (p != end && is_space(*p))
+			++p;
+		return p != end;
+	}
+
+	/* Next blank-delimited token, in place */
+	size_t token (const char *&tok) {
+		skip();
+		tok = p;
+		while (p != end && !is_space(*p))
+			++p;
+		return p - tok;
+	}
+
+	void skip_line () {
+		const char *nl = (const char *)memchr(p, '\n', end - p);
+		p = nl ? nl + 1 : end;
+	}
+};
+
+}
+
+#define MATCH(str, t) \
+	if (len == sizeof(str) - 1 && memcmp(name, str, len) == 0) { type = t; break; }
+
+Opcode::Opcode (const char *name, size_t len):
+	Opcode()
+{
+	if (len > 0) switch (name[0]) {
+	case 'a':
+		MATCH("add", ADD);
+		break;
+	case 'b':
+		MATCH("br", BR);
+		MATCH("blbc", BLBC);
+		MATCH("blbs", BLBS);
+		break;
+	case 'c':
+		MATCH("call", CALL);
+		MATCH("cmpeq", CMPEQ);
+		MATCH("cmple", CMPLE);
+		MATCH("cmplt", CMPLT);
+		break;
+	case 'd':
+		MATCH("div", DIV);
+		break;
+	case 'e':
+		MATCH("enter", ENTER);
+		MATCH("entrypc", ENTRYPC);
+		break;
+	case 'l':
+		MATCH("load", LOAD);
+		break;
+	case 'm':
+		MATCH("move", MOVE);
+		MATCH("mul", MUL);
+		MATCH("mod", MOD);
+		break;
+	case 'n':
+		MATCH("nop", NOP);
+		MATCH("neg", NEG);
+		break;
+	case 'p':
+		MATCH("param", PARAM);
+		break;
+	case 'r':
+		MATCH("ret", RET);
+		MATCH("read", READ);
+		break;
+	case 's':
+		MATCH("sub", SUB);
+		MATCH("store", STORE);
+		break;
+	case 'w':
+		MATCH("write", WRITE);
+		MATCH("wrl", WRL);
+		break;
+	}
+	if (type == UNKNOWN)
+		fprintf(stderr, "Unkown Opcode: %.*s\n", (int)len, name);
+}
+
+#undef MATCH
+
+Operand::Operand (const char *str, size_t len, Names &names):
+	Operand()
+{
+	const char *end = str + len;
+
+	if (len == 0) {
+		/* Nothing */
+	} else if (str[0] == '(') {
+		type = REG;
+		_value = parse_ll(str + 1, end);
+	} else if (str[0] == '[') {
+		type = LABEL;
+		_value = parse_ll(str + 1, end);
+	} else if (len == 2 && str[0] == 'G' && str[1] == 'P') {
+		type = GP;
+	} else if (len == 2 && str[0] == 'F' && str[1] == 'P') {
+		type = FP;
+	} else {
+		const char *sharp = (const char *)memchr(str, '#', len);
+		if (sharp == NULL) {
+			_value = parse_ll(str, end);
+			type = CONST;
+		} else {
+			_value = parse_ll(sharp + 1, end);
+			size_t n = sharp - str;
+			tag = names.intern(str, n);
+			if (n >= 5 && memcmp(sharp - 5, "_base", 5) == 0) {
+				type = CONST;
+			} else if (n >= 7 && memcmp(sharp - 7, "_offset", 7) == 0) {
+				type = CONST;
+			} else {
+				type = LOCAL;
+			}
+		}
+	}
+}
+
+static bool scan_instr (Scanner &in, Instruction &ins, Names &names)
+{
+	const char *tok;
+	size_t len;
+
+	len = in.token(tok);
+	if (len != 5 || memcmp(tok, "instr", 5) != 0)
+		return false;
+	len = in.token(tok);
+	if (len < 2 || tok[len - 1] != ':')
+		return false;
+	ins.name = parse_ll(tok, tok + len - 1);
+
+	len = in.token(tok);
+	ins.op = Opcode(tok, len);
+	for (int o = 0; o < ins.op.operands() && o < 2; ++o) {
+		len = in.token(tok);
+		ins.oper[o] = Operand(tok, len, names);
+	}
+	if (ins.op == Opcode::CALL) {
+		assert(ins.oper[0].type == Operand::LABEL);
+		ins.oper[0].type = Operand::FUNC;
+	}
+	return true;
+}
+
+Program::Program (const Source &src):
+	Program()
+{
+	if (src.is_binary()) {
+		read_binary(src);
+		return;
+	}
+
+	std::vector<Instruction> instr;
+	size_t lines = 0;
+	for (const char *p = src.data, *end = src.data + src.size; p != end; ++lines) {
+		const char *nl = (const char *)memchr(p, '\n', end - p);
+		p = nl ? nl + 1 : end;
+	}
+	instr.reserve(lines);
+
+	Scanner in(src.data, src.data + src.size);
+	while (in.skip()) {
+		const char *line = in.p;
+		instr.emplace_back();
+		if (!scan_instr(in, instr.back(), names)) {
+			in.p = line;
+			in.skip_line();
+			fprintf(stderr, "Malformed instruction: %.*s", (int)(in.p - line), line);
+			instr.pop_back();
+		}
+	}
+
+	split_functions(instr);
+}
+
+Stream::Stream (const Source &src):
+	begin(src.data), p(src.data), end(src.data + src.size)
+{
+}
+
+bool Stream::next (Program &prog)
+{
+	Scanner in(p, end);
+	bool entrypc = false;
+
+	instr.clear();
+	while (in.skip()) {
+		const char *line = in.p;
+		Instruction ins;
+		if (!scan_instr(in, ins, prog.names)) {
+			in.p = line;
+			in.skip_line();
+			fprintf(stderr, "Malformed instruction: %.*s", (int)(in.p - line), line);
+			continue;
+		}
+		if (instr.empty()) {
+			/* Between functions: only nop and entrypc */
+			if (ins.op == Opcode::ENTER)
+				instr.push_back(std::move(ins));
+			else
+				entrypc = ins.op == Opcode::ENTRYPC;
+			continue;
+		}
+		assert(ins.op != Opcode::ENTER);
+		instr.push_back(std::move(ins));
+		if (instr.back().op == Opcode::RET) {
+			p = in.p;
+			Function *f = new Function(&prog, instr.begin(), instr.end());
+			prog.funcs.push_back(f);
+			if (entrypc) {
+				assert(prog.main == NULL);
+				prog.main = f;
+			}
+			return true;
+		}
+	}
+	assert(instr.empty());
+	p = in.p;
+	return false;
+}
+
+int Stream::main_name () const
+{
+	static const char key[] = "entrypc";
+	const size_t n = sizeof key - 1;
+
+	for (const char *s = begin; (s = (const char *)memmem(s, end - s, key, n)) != NULL; s += n) {
+		if (s == begin || !is_space(s[-1]) || (s + n != end && !is_space(s[n])))
+			continue;
+		Scanner in(s + n, end);
+		const char *tok;
+		size_t len = in.token(tok);
+		if (len != 5 || memcmp(tok, "instr", 5) != 0)
+			continue;
+		len = in.token(tok);
+		if (len < 2 || tok[len - 1] != ':')
+			continue;
+		return parse_ll(tok, tok + len - 1);
+	}
+	return -1;
+}
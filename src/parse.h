@@ -0,0 +1,53 @@
+#ifndef PARSE_H
+#define PARSE_H
+
+#include <cstddef>
+#include <vector>
+
+/*
+ * Whole input of a 3-address program held in memory.  Regular files are
+ * mapped read-only; pipes and terminals are slurped with one bulk read.
+ * The text is not NUL-terminated, scanners must stop at data + size.
+ */
+struct Source {
+	const char *data;
+	size_t size;
+
+	Source (int fd);
+	~Source ();
+
+	/* Starts with the magic of Program::binary() */
+	bool is_binary () const;
+
+private:
+	bool mapped;
+	std::vector<char> buf;
+
+	Source (const Source &) = delete;
+	Source &operator= (const Source &) = delete;
+};
+
+struct Instruction;
+struct Program;
+
+/*
+ * Function-at-a-time reader over a text Source.  Each next() parses one
+ * enter ... ret range into a Function appended to prog (setting
+ * prog.main when it follows entrypc), so only the current function is
+ * ever held as IR.
+ */
+class Stream {
+public:
+	Stream (const Source &src);
+
+	bool next (Program &prog);
+
+	/* Name of the function after entrypc, found without parsing */
+	int main_name () const;
+
+private:
+	const char *begin, *p, *end;
+	std::vector<Instruction> instr;
+};
+
+#endif
@@ -0,0 +1,106 @@
+#include "pool.h"
+
+/* Tasks running on this thread, so a task's own run() goes inline */
+static thread_local int depth = 0;
+
+ThreadPool::ThreadPool (int workers):
+	task(nullptr), generation(0), pending(0), stop(false)
+{
+	if (workers < 1)
+		workers = 1;
+	for (int i = 0; i < workers; ++i)
+		queues.emplace_back(new Queue());
+	for (int i = 1; i < workers; ++i)
+		threads.emplace_back(&ThreadPool::loop, this, i);
+}
+
+ThreadPool::~ThreadPool ()
+{
+	{
+		std::lock_guard<std::mutex> g(lock);
+		stop = true;
+	}
+	wake.notify_all();
+	for (std::thread &t: threads)
+		t.join();
+}
+
+bool ThreadPool::pop (int self, size_t &item)
+{
+	int n = queues.size();
+	for (int k = 0; k < n; ++k) {
+		Queue &q = *queues[(self + k) % n];
+		std::lock_guard<std::mutex> g(q.lock);
+		if (q.items.empty())
+			continue;
+		if (k == 0) {
+			item = q.items.back();
+			q.items.pop_back();
+		} else {
+			item = q.items.front();
+			q.items.pop_front();
+		}
+		return true;
+	}
+	return false;
+}
+
+void ThreadPool::work (int self)
+{
+	size_t item;
+	while (pop(self, item)) {
+		++depth;
+		(*task)(item);
+		--depth;
+		if (--pending == 0) {
+			std::lock_guard<std::mutex> g(lock);
+			done.notify_all();
+		}
+	}
+}
+
+void ThreadPool::loop (int self)
+{
+	unsigned long seen = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> g(lock);
+			wake.wait(g, [&] { return stop || generation != seen; });
+			if (stop)
+				return;
+			seen = generation;
+		}
+		work(self);
+	}
+}
+
+void ThreadPool::run (size_t n, const std::function<void (size_t)> &t)
+{
+	if (n == 0)
+		return;
+	if (depth > 0) {
+		for (size_t i = 0; i < n; ++i)
+			t(i);
+		return;
+	}
+
+	/* task is published before any index, through the queue locks */
+	task = &t;
+	pending = n;
+	int workers = queues.size();
+	for (size_t i = 0; i < n; ++i) {
+		Queue &q = *queues[i * workers / n];
+		std::lock_guard<std::mutex> g(q.lock);
+		q.items.push_back(i);
+	}
+	{
+		std::lock_guard<std::mutex> g(lock);
+		++generation;
+	}
+	wake.notify_all();
+
+	work(0);
+
+	std::unique_lock<std::mutex> g(lock);
+	done.wait(g, [&] { return pending == 0; });
+}
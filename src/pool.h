@@ -0,0 +1,51 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Work-stealing thread pool for independent per-function jobs.  run()
+ * deals the indices out to one deque per worker; a worker takes from the
+ * back of its own deque and steals from the front of the others when it
+ * runs dry.  The calling thread works as worker 0.  A task may call
+ * run() itself, for nested work, which then runs on its own thread.
+ */
+class ThreadPool {
+public:
+	explicit ThreadPool (int workers);
+	~ThreadPool ();
+
+	int size () const { return queues.size(); }
+
+	/* Call task(i) for every i in [0, n), return when all are done */
+	void run (size_t n, const std::function<void (size_t)> &task);
+
+private:
+	struct Queue {
+		std::mutex lock;
+		std::deque<size_t> items;
+	};
+
+	std::vector<std::unique_ptr<Queue> > queues;
+	std::vector<std::thread> threads;
+	const std::function<void (size_t)> *task;
+
+	std::mutex lock;
+	std::condition_variable wake, done;
+	unsigned long generation;
+	std::atomic<size_t> pending;
+	bool stop;
+
+	bool pop (int self, size_t &item);
+	void work (int self);
+	void loop (int self);
+};
+
+#endif
@@ -0,0 +1,451 @@
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "dataflow.h"
+#include "icode.h"
+#include "output.h"
+
+/*
+ * Partial redundancy elimination by lazy code motion, after Knoop,
+ * Ruthing and Steffen, "Lazy Code Motion", in the edge form of Drechsler
+ * and Stadel.  An expression is an arithmetic opcode over two operands,
+ * the same wherever it is written; it is killed by a move to a local it
+ * reads, by the instruction defining a register it reads, and by a call
+ * if it reads any register, calls sharing the one register file.
+ *
+ * Computations go on the edges where they are anticipated and placing
+ * them any later would leave some path without, and the first one in a
+ * block they then reach is deleted.  Each expression moved gets a new
+ * local in the frame: every computation left of it, inserted or not,
+ * stores to it, and the uses of those deleted read it.  A register
+ * read by an expression being moved is only renamed to such a local
+ * afterwards, so expressions over registers wait for the next round,
+ * until a round moves nothing.
+ *
+ * Insertions on a critical edge go in a new block on it.
+ */
+
+namespace {
+
+struct Expr {
+	Opcode::Type op;
+	Operand::Type ta, tb;
+	long long a, b;
+
+	bool operator== (const Expr &o) const {
+		return op == o.op && ta == o.ta && tb == o.tb && a == o.a && b == o.b;
+	}
+};
+
+struct ExprHash {
+	size_t operator() (const Expr &e) const {
+		size_t h = std::hash<long long>()(e.a) * 31 + e.ta;
+		h = (h * 31 + std::hash<long long>()(e.b)) * 31 + e.tb;
+		return h * 31 + e.op;
+	}
+};
+
+/* Variable id, register id or constant, whichever the operand holds */
+long long payload(const Operand &o)
+{
+	switch (o.type) {
+	case Operand::LOCAL:
+		return o.var->id;
+	case Operand::REG:
+		return o.reg->id;
+	case Operand::CONST:
+		return o.value_const;
+	default:
+		return 0;
+	}
+}
+
+/* Anticipated expressions; blocks that never reach the exit anticipate nothing past themselves */
+struct Anticipated {
+	static const Dataflow::Direction direction = Dataflow::BACKWARD;
+	static const Dataflow::Meet meet = Dataflow::INTERSECT;
+
+	size_t n;
+	std::vector<BitVector> *antloc, *kill;
+	std::vector<char> exits;	// By block id, whether it reaches the exit
+
+	size_t bits () const { return n; }
+	void boundary (int, BitVector &) {}
+	void transfer (int b, const BitVector &out, BitVector &in) {
+		if (exits[b])
+			in.transfer(out, (*antloc)[b], (*kill)[b]);
+		else
+			in = (*antloc)[b];
+	}
+};
+
+struct Available {
+	static const Dataflow::Direction direction = Dataflow::FORWARD;
+	static const Dataflow::Meet meet = Dataflow::INTERSECT;
+
+	size_t n;
+	std::vector<BitVector> *comp, *kill;
+
+	size_t bits () const { return n; }
+	void boundary (int, BitVector &) {}
+	void transfer (int b, const BitVector &in, BitVector &out) { out.transfer(in, (*comp)[b], (*kill)[b]); }
+};
+
+class Lcm {
+public:
+	Lcm (Function *f): f(f) {}
+	bool round ();
+
+	int inserted = 0, deleted = 0;
+
+private:
+	Function *f;
+	size_t n = 0;				// Expressions computed more than once
+	std::vector<int> expr_of;		// By instruction id, -1 if none
+	std::vector<Instruction> proto;		// A computation of each expression
+	std::vector<std::vector<std::pair<Instruction*, int> > > uses;	// By instruction id
+	std::vector<std::vector<int> > by_var, by_reg;	// Expressions reading each
+	BitVector with_reg;			// Expressions reading a register
+	std::vector<BitVector> antloc, comp, kill;	// By block id
+	std::vector<Localvar*> temp;		// By expression, once moved
+	bool added = false;			// Blocks, on critical edges
+
+	void number ();
+	void local ();
+	void kills (const Instruction *in, BitVector &valid);
+	Localvar *temp_of (int e);
+	void insert (Block *from, Block *to, const BitVector &set);
+	void rewrite (Block *b, const BitVector &deleted, const BitVector &moved);
+};
+
+void Lcm::number ()
+{
+	std::unordered_map<Expr, int, ExprHash> ids;
+	std::vector<int> count;
+	expr_of.assign(f->instrs.size(), -1);
+	for (Instruction *in: f->instrs) {
+		if (in->op == Opcode::NOP || in->is_move() || in->op.traits_of().fold == 0)
+			continue;
+		Expr e = { in->op, in->oper[0].type, Operand::UNKNOWN, payload(in->oper[0]), 0 };
+		if (in->op.traits_of().fold > 1) {
+			e.tb = in->oper[1].type;
+			e.b = payload(in->oper[1]);
+		}
+		if ((in->op == Opcode::ADD || in->op == Opcode::MUL || in->op == Opcode::CMPEQ) &&
+				(e.tb < e.ta || (e.tb == e.ta && e.b < e.a))) {
+			std::swap(e.ta, e.tb);
+			std::swap(e.a, e.b);
+		}
+		auto it = ids.emplace(e, count.size()).first;
+		if (it->second == (int)count.size())
+			count.push_back(0);
+		++count[it->second];
+		expr_of[in->id] = it->second;
+	}
+
+	/* Keep those computed twice whose registers are not computed twice themselves */
+	std::vector<int> dense(count.size(), -1);
+	n = 0;
+	proto.clear();
+	for (Instruction *in: f->instrs) {
+		int e = expr_of[in->id];
+		if (e == -1 || count[e] < 2 || dense[e] != -1)
+			continue;
+		bool wait = false;
+		for (int o = 0; o < 2; ++o)
+			if (in->oper[o].type == Operand::REG && expr_of[in->oper[o].reg->id] != -1 &&
+					count[expr_of[in->oper[o].reg->id]] > 1)
+				wait = true;
+		if (wait) {
+			count[e] = 0;
+			continue;
+		}
+		dense[e] = n++;
+		proto.push_back(*in);
+	}
+	for (int &e: expr_of)
+		e = e == -1 ? -1 : dense[e];
+
+	uses.assign(f->instrs.size(), std::vector<std::pair<Instruction*, int> >());
+	for (Instruction *in: f->instrs)
+		for (int o = 0; o < 2; ++o)
+			if (in->isrightvalue(o) && in->oper[o].type == Operand::REG && expr_of[in->oper[o].reg->id] != -1)
+				uses[in->oper[o].reg->id].push_back(std::make_pair(in, o));
+
+	by_var.assign(f->localvars.size(), std::vector<int>());
+	by_reg.assign(f->instrs.size(), std::vector<int>());
+	with_reg = BitVector(n);
+	for (size_t e = 0; e < n; ++e)
+		for (int o = 0; o < 2; ++o) {
+			const Operand &op = proto[e].oper[o];
+			if (!proto[e].isrightvalue(o))
+				continue;
+			if (op.type == Operand::LOCAL)
+				by_var[op.var->id].push_back(e);
+			if (op.type == Operand::REG) {
+				by_reg[op.reg->id].push_back(e);
+				with_reg.set(e);
+			}
+		}
+}
+
+/* Clear from valid what in kills */
+void Lcm::kills (const Instruction *in, BitVector &valid)
+{
+	for (int e: by_reg[in->id])
+		valid.reset(e);
+	if (in->is_move() && in->oper[1].type == Operand::LOCAL)
+		for (int e: by_var[in->oper[1].var->id])
+			valid.reset(e);
+	if (in->op == Opcode::CALL)
+		valid.subtract(with_reg);
+}
+
+void Lcm::local ()
+{
+	int nb = f->blocks.size();
+	antloc.assign(nb, BitVector(n));
+	comp.assign(nb, BitVector(n));
+	kill.assign(nb, BitVector(n));
+	for (Block *b: f->blocks) {
+		BitVector alive(n, true);
+		for (Instruction *in: b->instr) {
+			int e = in->op == Opcode::NOP ? -1 : expr_of[in->id];
+			if (e != -1) {
+				if (alive.test(e))
+					antloc[b->id].set(e);
+				comp[b->id].set(e);
+			}
+			BitVector before = alive;
+			kills(in, alive);
+			before.subtract(alive);
+			comp[b->id].subtract(before);
+			kill[b->id].union_with(before);
+		}
+	}
+}
+
+Localvar *Lcm::temp_of (int e)
+{
+	if (temp[e] == NULL)
+		temp[e] = f->add_local(f->prog->pre_temp);
+	return temp[e];
+}
+
+/* Computes each expression in set on the edge */
+void Lcm::insert (Block *from, Block *to, const BitVector &set)
+{
+	std::vector<Instruction*> code;
+	set.each(set, [&](size_t e) {
+		Instruction *in = f->arena.make<Instruction>(proto[e]);
+		Instruction *save = f->arena.make<Instruction>();
+		save->op.type = Opcode::MOVE;
+		save->oper[0].type = Operand::REG;
+		save->oper[0].reg = in;
+		save->oper[1].type = Operand::LOCAL;
+		save->oper[1].var = temp_of(e);
+		code.push_back(in);
+		code.push_back(save);
+		++inserted;
+	});
+	if (code.empty())
+		return;
+
+	if (f->succs(from->id).size() > 1 && f->preds(to->id).size() > 1) {
+		Block *mid = f->split_edge(from, to);
+		mid->instr.insert(mid->instr.begin(), code.begin(), code.end());
+		added = true;
+	} else if (f->succs(from->id).size() > 1)
+		to->instr.insert(to->instr.begin(), code.begin(), code.end());
+	else
+		from->instr.insert(from->br_next != NULL ? from->instr.end() - 1 : from->instr.end(),
+				code.begin(), code.end());
+}
+
+/* t stands in for the first computation of each deleted, the others of each moved keep it */
+void Lcm::rewrite (Block *b, const BitVector &deleted_at, const BitVector &moved)
+{
+	std::vector<Instruction*> instr;
+	BitVector valid = deleted_at;
+	for (Instruction *in: b->instr) {
+		int e = in->op == Opcode::NOP ? -1 : expr_of[in->id];
+		if (e != -1 && valid.test(e)) {
+			Operand t;
+			t.type = Operand::LOCAL;
+			t.var = temp_of(e);
+			for (auto &u: uses[in->id])
+				u.first->oper[u.second] = t;
+			in->erase();
+			++deleted;
+			instr.push_back(in);
+			continue;
+		}
+		instr.push_back(in);
+		kills(in, valid);
+		if (e != -1 && moved.test(e)) {
+			Instruction *save = f->arena.make<Instruction>();
+			save->op.type = Opcode::MOVE;
+			save->oper[0].type = Operand::REG;
+			save->oper[0].reg = in;
+			save->oper[1].type = Operand::LOCAL;
+			save->oper[1].var = temp_of(e);
+			instr.push_back(save);
+			valid.set(e);
+		}
+	}
+	b->instr.swap(instr);
+}
+
+bool Lcm::round ()
+{
+	f->index();
+	number();
+	if (n == 0)
+		return false;
+	local();
+
+	int nb = f->blocks.size();
+	std::vector<char> reached(nb, 0);
+	for (int b: f->rpo)
+		reached[b] = 1;
+
+	Anticipated ant;
+	ant.n = n;
+	ant.antloc = &antloc;
+	ant.kill = &kill;
+	ant.exits.assign(nb, 0);
+	std::vector<int> work;
+	for (int b = 0; b < nb; ++b)
+		if (f->succs(b).size() == 0) {
+			ant.exits[b] = 1;
+			work.push_back(b);
+		}
+	while (!work.empty()) {
+		int b = work.back();
+		work.pop_back();
+		for (int p: f->preds(b))
+			if (!ant.exits[p]) {
+				ant.exits[p] = 1;
+				work.push_back(p);
+			}
+	}
+	DataflowSolver<Anticipated> antsolver(f, ant);
+	antsolver.solve();
+	std::vector<BitVector> &antin = antsolver.in, &antout = antsolver.out;
+
+	Available av;
+	av.n = n;
+	av.comp = &comp;
+	av.kill = &kill;
+	DataflowSolver<Available> avsolver(f, av);
+	avsolver.solve();
+	std::vector<BitVector> &avout = avsolver.out;
+
+	/* earliest(i, j) = antin[j] & x[i]; later(i, j) = earliest(i, j) | y[i] */
+	std::vector<BitVector> x(nb, BitVector(n, true));
+	for (int b = 0; b < nb; ++b) {
+		BitVector z = antout[b];
+		z.subtract(kill[b]);
+		z.union_with(avout[b]);
+		x[b].subtract(z);
+	}
+	auto later = [&](int i, int j, const std::vector<BitVector> &laterin, BitVector &out) {
+		out = antin[j];
+		out.intersect_with(x[i]);
+		BitVector y = laterin[i];
+		y.subtract(antloc[i]);
+		out.union_with(y);
+	};
+
+	int entry = f->entry->id;
+	std::vector<BitVector> laterin(nb, BitVector(n, true));
+	BitVector acc(n), edge(n);
+	bool change;
+	do {
+		change = false;
+		for (int j: f->rpo) {
+			acc = j == entry ? antin[j] : BitVector(n, true);
+			for (int i: f->preds(j)) if (reached[i]) {
+				later(i, j, laterin, edge);
+				acc.intersect_with(edge);
+			}
+			if (acc != laterin[j]) {
+				laterin[j].swap(acc);
+				change = true;
+			}
+		}
+	} while (change);
+
+	/* Expressions with an insertion or deletion */
+	std::vector<std::pair<std::pair<int, int>, BitVector> > inserts;
+	BitVector moved(n);
+	for (int i: f->rpo)
+		for (int j: f->succs(i)) {
+			later(i, j, laterin, edge);
+			edge.subtract(laterin[j]);
+			if (edge == BitVector(n))
+				continue;
+			moved.union_with(edge);
+			inserts.push_back(std::make_pair(std::make_pair(i, j), edge));
+		}
+	std::vector<BitVector> del(nb, BitVector(n));
+	for (int b: f->rpo) {
+		del[b] = antloc[b];
+		del[b].subtract(laterin[b]);
+		moved.union_with(del[b]);
+	}
+	/* A second computation in a block, not killed in between, goes too */
+	for (Block *b: f->blocks) {
+		BitVector seen(n);
+		for (Instruction *in: b->instr) {
+			int e = in->op == Opcode::NOP ? -1 : expr_of[in->id];
+			if (e != -1) {
+				if (seen.test(e))
+					moved.set(e);
+				seen.set(e);
+			}
+			kills(in, seen);
+		}
+	}
+	if (moved == BitVector(n))
+		return false;
+
+	temp.assign(n, NULL);
+	added = false;
+	for (Block *b: f->blocks) {
+		del[b->id].intersect_with(moved);
+		rewrite(b, del[b->id], moved);
+	}
+	for (auto &ins: inserts) {
+		ins.second.intersect_with(moved);
+		insert(f->blocks[ins.first.first], f->blocks[ins.first.second], ins.second);
+	}
+
+	f->index();
+	if (added)
+		f->build_domtree();
+	return true;
+}
+
+}
+
+void Function::partial_redundancy()
+{
+	Lcm lcm(this);
+	while (lcm.round())
+		;
+
+	if (prog->output_report) {
+		report(std_out, "Function: %d\n", name);
+		report(std_out, "Number of expressions inserted (PRE): %d\n", lcm.inserted);
+		report(std_out, "Number of redundant expressions deleted (PRE): %d\n", lcm.deleted);
+	}
+}
+
+void Program::partial_redundancy()
+{
+	pre_temp = names.intern("pre", 3);
+	each_function(&Function::partial_redundancy);
+}
@@ -0,0 +1,316 @@
+#include <algorithm>
+#include <initializer_list>
+#include <utility>
+#include <vector>
+
+#include "icode.h"
+#include "output.h"
+
+using std::vector;
+using std::pair;
+using std::make_pair;
+
+/*
+ * Sparse conditional constant propagation, after Wegman and Zadeck,
+ * "Constant Propagation with Conditional Branches".  Every SSA value
+ * sits on a three level lattice, undefined above one constant above
+ * overdefined, and only moves down.  Blocks are evaluated once some
+ * edge into them is found executable, and a value that moves down sends
+ * its uses in executable blocks round again.  Operands only read the
+ * phi operands on executable edges, so constants flow past branches
+ * whose condition is known.
+ *
+ * Afterwards constants replace the uses of their values, the folded
+ * definitions and phis go, and a blbc or blbs with a known condition
+ * becomes a br or falls through.  Blocks no longer reached stay in the
+ * layout but lose their code and out edges, and the dominator tree and
+ * loops are built again once for all the edges dropped.
+ */
+
+namespace {
+
+struct Lattice {
+    enum Level : char { TOP, CONST, BOTTOM } level;
+    long long c;
+
+    bool operator!= (const Lattice& o) const { return level != o.level || (level == CONST && c != o.c); }
+};
+
+const Lattice top = { Lattice::TOP, 0 };
+const Lattice bottom = { Lattice::BOTTOM, 0 };
+
+Lattice constant(long long c)
+{
+    return Lattice{ Lattice::CONST, c };
+}
+
+Lattice meet(const Lattice& a, const Lattice& b)
+{
+    if (a.level == Lattice::TOP) return b;
+    if (b.level == Lattice::TOP) return a;
+    if (a.level == Lattice::BOTTOM || b.level == Lattice::BOTTOM || a.c != b.c) return bottom;
+    return a;
+}
+
+class Sccp {
+public:
+    Sccp(Function* f);
+    void solve();
+
+    Function* f;
+    vector<Lattice> val;     // By value id
+    vector<char> reached;    // By block id
+    vector<char> taken;      // Out edges by block id times two, seq_next then br_next
+
+private:
+    vector<pair<int, int> > cfg_work;  // Edges just taken, as (block, 0 or 1)
+    vector<int> ssa_work;              // Values just moved down
+    vector<char> read;                 // By value id, whether some use has looked
+
+    Lattice get(const Operand& o);
+    void lower(int value, const Lattice& l);
+    bool executable(Block* from, Block* to) const;
+    void take(Block* b, int which);
+    void visit_phi(Block* b, Phi& phi);
+    void visit_operand(Block* b, Phi& phi, size_t i);
+    void visit(Block* b, Instruction* in);
+    void visit_block(Block* b);
+};
+
+Sccp::Sccp(Function* f): f(f), val(f->value_block.size(), top),
+    reached(f->blocks.size(), 0), taken(2 * f->blocks.size(), 0), read(val.size(), 0)
+{
+    // A variable on entry could be anything
+    for (int base : f->ssa_value_base)
+        val[base] = bottom;
+}
+
+Lattice Sccp::get(const Operand& o)
+{
+    if (o.is_const())
+        return constant(o.value_const);
+    int v = f->value_of(o);
+    if (v < 0)
+        return bottom;
+    read[v] = 1;
+    return val[v];
+}
+
+/* Uses not yet visited will see the new value when their block is reached */
+void Sccp::lower(int value, const Lattice& l)
+{
+    Lattice m = meet(val[value], l);
+    if (m != val[value]) {
+        val[value] = m;
+        if (read[value])
+            ssa_work.push_back(value);
+    }
+}
+
+bool Sccp::executable(Block* from, Block* to) const
+{
+    return (from->seq_next == to && taken[2 * from->id]) || (from->br_next == to && taken[2 * from->id + 1]);
+}
+
+void Sccp::take(Block* b, int which)
+{
+    if ((which ? b->br_next : b->seq_next) == nullptr || taken[2 * b->id + which]) return;
+    taken[2 * b->id + which] = 1;
+    cfg_work.push_back(make_pair(b->id, which));
+}
+
+void Sccp::visit_phi(Block* b, Phi& phi)
+{
+    if (phi.empty()) return;  // Folded by an earlier pass
+    Lattice l = top;
+    for (size_t i = 0; i < phi.r.size(); ++i)
+        if (executable(phi.pre[i], b))
+            l = meet(l, get(phi.r[i]));
+    lower(f->ssa_value_base[phi.var->id] + phi.l, l);
+}
+
+/* Values only move down, so one operand that changed meets into the rest */
+void Sccp::visit_operand(Block* b, Phi& phi, size_t i)
+{
+    if (!phi.empty() && executable(phi.pre[i], b))
+        lower(f->ssa_value_base[phi.var->id] + phi.l, get(phi.r[i]));
+}
+
+void Sccp::visit(Block* b, Instruction* in)
+{
+    switch (in->op) {
+    case Opcode::NOP:
+        return;
+    case Opcode::BR:
+        take(b, 1);
+        return;
+    case Opcode::BLBC:
+    case Opcode::BLBS: {
+        Lattice c = get(in->oper[0]);
+        if (c.level == Lattice::CONST)
+            take(b, (c.c & 1) == (in->op == Opcode::BLBS));
+        else if (c.level == Lattice::BOTTOM) {
+            take(b, 0);
+            take(b, 1);
+        }
+        return;
+    }
+    default:
+        break;
+    }
+
+    int fold = in->op.traits_of().fold;
+    Lattice l = bottom;
+    if (fold > 0) {
+        Lattice a = get(in->oper[0]);
+        Lattice c = fold > 1 ? get(in->oper[1]) : constant(0);
+        if (a.level == Lattice::BOTTOM || c.level == Lattice::BOTTOM) {
+            l = bottom;
+        } else if (a.level == Lattice::TOP || c.level == Lattice::TOP) {
+            l = top;
+        } else if ((in->op == Opcode::DIV || in->op == Opcode::MOD) && c.c == 0) {
+            l = bottom;  // Left for run time
+        } else {
+            Instruction folded(*in);
+            folded.oper[0].to_const(a.c);
+            if (fold > 1)
+                folded.oper[1].to_const(c.c);
+            l = constant(folded.constvalue());
+        }
+    }
+    lower(in->id, l);
+    if (in->is_move() && in->oper[1].is_local())
+        lower(f->value_of(in->oper[1]), l);
+}
+
+void Sccp::visit_block(Block* b)
+{
+    for (Phi& phi : b->phi)
+        visit_phi(b, phi);
+    for (Instruction* in : b->instr)
+        visit(b, in);
+    Opcode::Type last = b->instr.back()->op;
+    if (last != Opcode::BR && last != Opcode::BLBC && last != Opcode::BLBS)
+        take(b, 0);
+}
+
+void Sccp::solve()
+{
+    reached[f->entry->id] = 1;
+    visit_block(f->entry);
+    while (!cfg_work.empty() || !ssa_work.empty()) {
+        while (!cfg_work.empty()) {
+            Block* from = f->blocks[cfg_work.back().first];
+            Block* b = cfg_work.back().second ? from->br_next : from->seq_next;
+            cfg_work.pop_back();
+            if (!reached[b->id]) {
+                reached[b->id] = 1;
+                visit_block(b);
+            } else {
+                for (Phi& phi : b->phi)
+                    for (size_t i = 0; i < phi.pre.size(); ++i)
+                        if (phi.pre[i] == from)
+                            visit_operand(b, phi, i);
+            }
+        }
+        while (!ssa_work.empty() && cfg_work.empty()) {
+            int v = ssa_work.back();
+            ssa_work.pop_back();
+            for (const Use& u : f->value_uses[v]) {
+                if (!reached[u.block->id]) continue;
+                if (u.in == nullptr)
+                    visit_operand(u.block, u.block->phi[u.phi], u.o);
+                else
+                    visit(u.block, u.in);
+            }
+        }
+    }
+}
+
+}
+
+void Function::ssa_sccp()
+{
+    ssa_index();
+    Sccp s(this);
+    s.solve();
+
+    int propagated = 0, folded = 0, unreachable = 0;
+    for (size_t v = 0; v < s.val.size(); ++v) {
+        if (s.val[v].level != Lattice::CONST) continue;
+        for (const Use& u : value_uses[v])
+            if (u.in ? u.in->op != Opcode::NOP : !u.block->phi[u.phi].r.empty())
+                ++propagated;
+        Operand c;
+        c.to_const(s.val[v].c);
+        replace_all_uses(v, c);
+    }
+
+    vector<pair<Block*, Block*> > dropped;
+    auto drop = [&](Block* b, Block* gone) {
+        gone->prevs.erase(std::find(gone->prevs.begin(), gone->prevs.end(), b));
+        ssa_remove_edge(b, gone);
+        dropped.push_back(make_pair(b, gone));
+    };
+    for (Block* b : blocks) {
+        if (!s.reached[b->id]) {
+            // Only the ret stays, should the function end here
+            ++unreachable;
+            for (Phi& phi : b->phi)
+                phi.clear();
+            for (Instruction* in : b->instr)
+                if (in->op != Opcode::RET)
+                    in->erase();
+            for (Block** next : { &b->seq_next, &b->br_next })
+                if (*next != nullptr) {
+                    drop(b, *next);
+                    *next = nullptr;
+                }
+            continue;
+        }
+        for (Phi& phi : b->phi)
+            if (!phi.empty() && s.val[ssa_value_base[phi.var->id] + phi.l].level == Lattice::CONST)
+                phi.clear();
+        for (Instruction* in : b->instr)
+            if (in->op != Opcode::NOP && in->op.traits_of().fold > 0 && s.val[in->id].level == Lattice::CONST)
+                in->erase();
+
+        // Both edges taken, or neither if the condition was never defined
+        Instruction* br = b->instr.back();
+        if ((br->op != Opcode::BLBC && br->op != Opcode::BLBS) || s.taken[2 * b->id] == s.taken[2 * b->id + 1])
+            continue;
+        ++folded;
+        Block* gone;
+        if (s.taken[2 * b->id + 1]) {
+            gone = b->seq_next;
+            b->seq_next = nullptr;
+            br->op.type = Opcode::BR;
+            br->oper[0] = br->oper[1];
+            br->oper[1] = Operand();
+        } else {
+            gone = b->br_next;
+            b->br_next = nullptr;
+            br->erase();
+        }
+        drop(b, gone);
+    }
+
+    // Unreachable blocks can drop many edges, so rebuild rather than update
+    if (!dropped.empty()) {
+        index();
+        build_domtree();
+        ssa_update();
+    }
+
+    if (prog->output_report) {
+        report(std_out, "Function: %d\n", name);
+        report(std_out, "Number of constants propagated (SCCP): %d\n", propagated);
+        report(std_out, "Number of branches folded: %d\n", folded);
+        report(std_out, "Number of unreachable blocks: %d\n", unreachable);
+    }
+}
+
+void Program::ssa_sccp()
+{
+    each_function(&Function::ssa_sccp);
+}
@@ -0,0 +1,242 @@
+#include <algorithm>
+#include <initializer_list>
+#include <vector>
+
+#include "icode.h"
+#include "output.h"
+
+/*
+ * CFG simplification.  Rounds of four rewrites run until none applies:
+ * blocks out of reach of the entry go; a br to the block laid out next
+ * becomes a fallthrough; a block with nothing but NOPs and maybe a br is
+ * bypassed, its predecessors going straight to its successor; and a
+ * block is merged into its only predecessor when that has no other
+ * successor.  Each round compacts the NOPs away and renumbers.
+ *
+ * The layout only changes by blocks leaving it, so a block can only be
+ * merged into a predecessor that falls into it, or that branches to it
+ * when it does not fall through itself.  A block still ends after a
+ * call.  The last block holds the ret and stays even out of reach.
+ *
+ * In SSA a block with phis is neither bypassed nor merged, nor is a
+ * block bypassed into one with phis; the edges of removed blocks are
+ * reported and drop their phi operands.  The dominator tree and loops
+ * are built again at the end.
+ */
+
+namespace {
+
+class SimplifyCfg {
+public:
+	SimplifyCfg (Function *f): f(f) {}
+	bool round ();
+	int removed = 0, folded = 0, bypassed = 0, merged = 0;
+
+private:
+	Function *f;
+	std::vector<Block*> layout_prev;	// By block id
+	std::vector<char> dead;			// By block id
+
+	static bool has_phis (const Block *b);
+	void unlink (Block *b);
+	void remove (Block *b);
+	void retarget (Block *p, Block *from, Block *to);
+	bool bypass (Block *e);
+	bool merge (Block *b);
+};
+
+bool SimplifyCfg::has_phis (const Block *b)
+{
+	for (const Phi &phi: b->phi)
+		if (!phi.empty())
+			return true;
+	return false;
+}
+
+/* Takes b out of the layout */
+void SimplifyCfg::unlink (Block *b)
+{
+	Block *prev = layout_prev[b->id];
+	prev->order_next = b->order_next;
+	if (b->order_next != nullptr)
+		layout_prev[b->order_next->id] = prev;
+}
+
+/* Takes b out with its out edges, whatever still leads to it is out of reach too */
+void SimplifyCfg::remove (Block *b)
+{
+	for (Block **next: { &b->seq_next, &b->br_next })
+		if (*next != nullptr) {
+			Block *s = *next;
+			s->prevs.erase(std::find(s->prevs.begin(), s->prevs.end(), b));
+			if (!s->phi.empty())
+				f->ssa_remove_edge(b, s);
+			*next = nullptr;
+		}
+	unlink(b);
+	dead[b->id] = 1;
+}
+
+/* Points p's edge to from at to instead */
+void SimplifyCfg::retarget (Block *p, Block *from, Block *to)
+{
+	from->prevs.erase(std::find(from->prevs.begin(), from->prevs.end(), p));
+	if (p->seq_next == from) {
+		p->seq_next = to;
+	} else {
+		p->br_next = to;
+		p->instr.back()->set_branch(to);
+	}
+	if (p->seq_next == p->br_next) {
+		// Both ways lead to the same place: a blbc, or an erased br, goes
+		p->br_next = nullptr;
+		p->instr.back()->erase();
+		return;
+	}
+	to->prevs.push_back(p);
+}
+
+/* Sends e's predecessors past it, when it has nothing to run */
+bool SimplifyCfg::bypass (Block *e)
+{
+	if (e == f->entry || has_phis(e))
+		return false;
+	for (Instruction *in: e->instr)
+		if (in->op != Opcode::NOP && in->op != Opcode::BR)
+			return false;
+	Block *to = e->seq_next != nullptr ? e->seq_next : e->br_next;
+	if (to == nullptr || to == e || has_phis(to))
+		return false;
+
+	bool jumps = e->br_next != nullptr;
+	std::vector<Block*> prevs(e->prevs);
+	bool change = false;
+	for (Block *p: prevs) {
+		// Falling into e only goes on to its successor if e is left out
+		if (p->seq_next == e && (jumps || p->order_next != e))
+			continue;
+		retarget(p, e, to);
+		change = true;
+	}
+	if (e->prevs.empty()) {
+		remove(e);
+		++bypassed;
+	}
+	return change;
+}
+
+/* Appends b's only successor to b, if b is all that leads there */
+bool SimplifyCfg::merge (Block *b)
+{
+	Block *s = b->seq_next != nullptr ? b->seq_next : b->br_next;
+	if (s == nullptr || (b->seq_next != nullptr && b->br_next != nullptr))
+		return false;
+	if (s == b || s == f->entry || s->prevs.size() != 1 || has_phis(s))
+		return false;
+	Instruction *last = b->instr.back();
+	if (last->op == Opcode::CALL)
+		return false;
+	bool falls = s == b->order_next;
+	if (!falls && (s->seq_next != nullptr || s->order_next == nullptr))
+		return false;
+
+	if (last->op == Opcode::BR)
+		last->erase();
+	b->instr.insert(b->instr.end(), s->instr.begin(), s->instr.end());
+	b->seq_next = s->seq_next;
+	b->br_next = s->br_next;
+	for (Block *t: { s->seq_next, s->br_next }) {
+		if (t == nullptr)
+			continue;
+		std::replace(t->prevs.begin(), t->prevs.end(), s, b);
+		for (Phi &phi: t->phi)
+			std::replace(phi.pre.begin(), phi.pre.end(), s, b);
+	}
+	s->seq_next = s->br_next = nullptr;
+	unlink(s);
+	dead[s->id] = 1;
+	++merged;
+	return true;
+}
+
+bool SimplifyCfg::round ()
+{
+	int nb = f->blocks.size();
+	layout_prev.assign(nb, nullptr);
+	dead.assign(nb, 0);
+	for (Block *b = f->entry; b->order_next != nullptr; b = b->order_next)
+		layout_prev[b->order_next->id] = b;
+	bool change = false;
+
+	// Out of reach: what the rpo misses, but for the ret
+	std::vector<char> reached(nb, 0);
+	for (int b: f->rpo)
+		reached[b] = 1;
+	for (Block *b: f->blocks) {
+		if (reached[b->id])
+			continue;
+		if (b->order_next == nullptr) {
+			for (Instruction *in: b->instr)
+				if (in->op != Opcode::RET && in->op != Opcode::NOP) {
+					in->erase();
+					change = true;
+				}
+			continue;
+		}
+		remove(b);
+		++removed;
+		change = true;
+	}
+
+	for (Block *b = f->entry; b != nullptr; b = b->order_next) {
+		Instruction *last = b->instr.back();
+		if (last->op == Opcode::BR && b->br_next == b->order_next) {
+			last->erase();
+			b->seq_next = b->br_next;
+			b->br_next = nullptr;
+			++folded;
+			change = true;
+		}
+	}
+
+	for (Block *b = f->entry; b != nullptr; ) {
+		Block *next = b->order_next;
+		if (bypass(b))
+			change = true;
+		b = next;
+	}
+	for (Block *b = f->entry; b != nullptr; b = b->order_next)
+		while (merge(b))
+			change = true;
+
+	f->blocks.erase(std::remove_if(f->blocks.begin(), f->blocks.end(), [&](Block *b) {
+		return dead[b->id];
+	}), f->blocks.end());
+	f->ssa_update();
+	f->compact();
+	return change;
+}
+
+}
+
+void Function::simplify_cfg()
+{
+	compact();
+	SimplifyCfg s(this);
+	while (s.round())
+		;
+	build_domtree();
+
+	if (prog->output_report) {
+		report(std_out, "Function: %d\n", name);
+		report(std_out, "Number of unreachable blocks removed: %d\n", s.removed);
+		report(std_out, "Number of branches to the next block removed: %d\n", s.folded);
+		report(std_out, "Number of empty blocks bypassed: %d\n", s.bypassed);
+		report(std_out, "Number of blocks merged: %d\n", s.merged);
+	}
+}
+
+void Program::simplify_cfg()
+{
+	each_function(&Function::simplify_cfg);
+}
@@ -1,4 +1,7 @@
+#include "dataflow.h"
 #include "icode.h"
+#include "output.h"
+#include "pool.h"
 
 #include <cassert>
 #include <algorithm>
@@ -7,68 +10,186 @@
 using std::string;
 using std::vector;
 using std::map;
-using std::multimap;
 using std::unordered_set;
 using std::unordered_map;
 using std::pair;
 using std::make_pair;
 
-static inline bool is_ancestor(Block* x, Block* y)
+/*
+ * Dominance frontiers as in Cooper, Harvey and Kennedy: walk up from
+ * each predecessor of a join until reaching the join's idom, adding
+ * the join to every frontier on the way.  The entry counts as a join,
+ * having an implicit edge in.
+ */
+void Function::compute_df()
 {
-    while (y != x && y != nullptr)
-        y = y->idom;
-    return y == x;
+    int nb = blocks.size();
+    vector<int> last(nb, -1); // Join most recently added to a block's df
+    for (Block* b : blocks)
+        b->df.clear();
+    for (Block* b : blocks) {
+        if (b->dom_depth < 0 || (b->prevs.size() < 2 && b != entry)) continue;
+        for (Block* p : b->prevs) {
+            if (p->dom_depth < 0) continue;
+            for (Block* runner = p; runner != b->idom; runner = runner->idom)
+                if (last[runner->id] != b->id) {
+                    last[runner->id] = b->id;
+                    runner->df.push_back(b);
+                }
+        }
+    }
 }
 
-void Block::compute_df()
-{
-    unordered_set<Block*> df_set;
-
-    if (seq_next && seq_next->idom != this)
-        df_set.insert(seq_next);
-    if (br_next && br_next->idom != this)
-        df_set.insert(br_next);
-
-    for (Block* child : domc) {
-        child->compute_df();
-        for (Block* child_df : child->df)
-            if (this == child_df || !is_ancestor(this, child_df))
-                df_set.insert(child_df);
-    }
+const char *ssaformname[] = {
+    [MINIMAL_SSA] = "minimal",
+    [SEMI_PRUNED_SSA] = "semi-pruned",
+    [PRUNED_SSA] = "pruned",
+};
 
-    df = vector<Block*>(df_set.cbegin(), df_set.cend());
-}
+namespace {
+
+/*
+ * Plain liveness of local variables: upward exposed uses against
+ * definitions, every operand counting as a use whether or not its
+ * instruction is dead.  Renaming reads the same operands.
+ */
+struct VarLiveness {
+    static const Dataflow::Direction direction = Dataflow::BACKWARD;
+    static const Dataflow::Meet meet = Dataflow::UNION;
+
+    Function* func;
+    vector<BitVector> gen, kill;  // By block id
+
+    size_t bits() const { return func->localvars.size(); }
+    void boundary(int, BitVector&) {}
+    void transfer(int b, const BitVector& out, BitVector& in) { in.transfer(out, gen[b], kill[b]); }
+
+    void init(Function* f)
+    {
+        func = f;
+        gen.assign(f->blocks.size(), BitVector(bits()));
+        kill.assign(f->blocks.size(), BitVector(bits()));
+        for (Block* b : f->blocks)
+            for (Instruction* in : b->instr) {
+                for (int o = 0; o < 2; ++o) {
+                    if (!in->oper[o].is_local() || (o == 1 && in->is_move())) continue;
+                    int v = in->oper[o].var->id;
+                    if (!kill[b->id].test(v))
+                        gen[b->id].set(v);
+                }
+                if (in->is_move() && in->oper[1].is_local())
+                    kill[b->id].set(in->oper[1].var->id);
+            }
+    }
+};
 
-void Block::find_defs()
-{
-    for (Instruction* in : instr)
-        if (in->is_move() && in->oper[1].is_local())
-            defs.insert(in->oper[1].var);
 }
 
+/*
+ * Phi placement, one variable at a time over the iterated dominance
+ * frontier of its definitions.  Semi-pruned form leaves out variables
+ * never live into a block, pruned form every phi whose variable is dead
+ * on entry to its block.  Variables go in frame offset order, so each
+ * block's phis come out sorted by it.
+ */
 void Function::place_phi()
 {
-    unordered_map<Localvar*, vector<Block*>> def_sites;
+    int nb = blocks.size(), nv = localvars.size();
 
+    // Blocks defining each variable, once each, in CSR form by variable id
+    vector<int> site_start(nv + 1, 0), site_list, last(nv, -1);
+    vector<pair<int, int> > defs;
     for (Block* b : blocks)
-        for (Localvar* var : b->defs)
-            def_sites[var].push_back(b);
-
-    for (auto& var_blocks : def_sites) {
-        Localvar* var = var_blocks.first;
-        auto& blocks = var_blocks.second;
-
-        while (!blocks.empty()) {
-            Block* b = blocks.back();
-            blocks.pop_back();
-
-            for (Block* df : b->df)
-                if (df->phi.count(var) == 0) {
-                    df->phi[var].init(df->prevs);
-                    if (df->defs.count(var) == 0)
-                        blocks.push_back(df);
+        for (Instruction* in : b->instr)
+            if (in->is_move() && in->oper[1].is_local()) {
+                int v = in->oper[1].var->id;
+                if (last[v] != b->id) {
+                    last[v] = b->id;
+                    defs.push_back(make_pair(v, b->id));
+                    ++site_start[v + 1];
                 }
+            }
+    for (int v = 0; v < nv; ++v)
+        site_start[v + 1] += site_start[v];
+    site_list.resize(defs.size());
+    vector<int> fill(site_start.begin(), site_start.end() - 1);
+    for (auto& def : defs)
+        site_list[fill[def.first]++] = def.second;
+
+    vector<Localvar*> order(localvars);
+    std::sort(order.begin(), order.end(), VarLess());
+
+    SsaForm form = prog->ssa_form;
+    VarLiveness lv;
+    DataflowSolver<VarLiveness> solver(this, lv);
+    BitVector global(nv, form == MINIMAL_SSA);
+    if (form != MINIMAL_SSA) {
+        lv.init(this);
+        for (const BitVector& g : lv.gen)
+            global.union_with(g);
+        if (form == PRUNED_SSA)
+            solver.solve();
+    }
+
+    // Variables are placed independently, so contiguous runs of them go
+    // to the thread pool, each leaving its (block, variable) pairs in a
+    // buffer of its own.  Merging the buffers in run order appends to
+    // each block in variable order, just as one run over all would.
+    vector<Localvar*> vars;
+    for (Localvar* var : order)
+        if (global.test(var->id))
+            vars.push_back(var);
+    ThreadPool* pool = prog->pool;
+    size_t runs = pool == nullptr ? 1 : std::min<size_t>(pool->size() * 4, vars.size() / 64 + 1);
+    vector<vector<pair<int, Localvar*> > > placed_by(runs);
+
+    auto place = [&](size_t r) {
+        vector<int> has_phi(nb, -1), queued(nb, -1), work;
+        vector<pair<int, Localvar*> >& out = placed_by[r];
+        for (size_t k = vars.size() * r / runs; k < vars.size() * (r + 1) / runs; ++k) {
+            Localvar* var = vars[k];
+            int v = var->id;
+            for (int i = site_start[v]; i < site_start[v + 1]; ++i) {
+                queued[site_list[i]] = v;
+                work.push_back(site_list[i]);
+            }
+            while (!work.empty()) {
+                Block* b = blocks[work.back()];
+                work.pop_back();
+                for (Block* df : b->df)
+                    if (has_phi[df->id] != v) {
+                        has_phi[df->id] = v;
+                        // A dead phi still counts as a definition for the frontier
+                        if (form != PRUNED_SSA || solver.in[df->id].test(v))
+                            out.push_back(make_pair(df->id, var));
+                        if (queued[df->id] != v) {
+                            queued[df->id] = v;
+                            work.push_back(df->id);
+                        }
+                    }
+            }
         }
+    };
+    if (runs > 1)
+        pool->run(runs, place);
+    else
+        place(0);
+
+    for (Block* b : blocks)
+        b->phi.clear();
+    int placed = 0;
+    for (auto& out : placed_by)
+        for (auto& p : out) {
+            Block* b = blocks[p.first];
+            b->phi.push_back(Phi());
+            b->phi.back().var = p.second;
+            b->phi.back().init(b->prevs);
+            ++placed;
+        }
+
+    if (prog->output_report) {
+        report(std_out, "Function: %d\n", name);
+        report(std_out, "Number of phi nodes placed (%s SSA): %d\n", ssaformname[form], placed);
     }
 }
 
@@ -81,57 +202,79 @@ static Operand ssa_oper(Localvar* var, int idx)
     return r;
 }
 
-static void rename_phi(Block* child, Block* parent, map<Localvar*, RenameStack>& stack)
+static void rename_phi(Block* child, Block* parent, const vector<int>& top)
 {
     if (child == nullptr) return;
 
     auto it = std::find(child->prevs.cbegin(), child->prevs.cend(), parent);
     int p = it - child->prevs.cbegin();
 
-    for (auto& var_phi : child->phi) {
-        Localvar* var = var_phi.first;
-        Phi& phi = var_phi.second;
-        phi.r[p] = ssa_oper(var, stack[var].top());
+    for (Phi& phi : child->phi) {
+        phi.r[p] = ssa_oper(phi.var, top[phi.var->id]);
         phi.pre[p] = parent;
     }
 }
 
-static Operand reg_oper(Instruction* in)
+/*
+ * Renames down the dominator tree with an explicit stack.  top[v] is
+ * the version of variable v in scope, version 0 standing for its value
+ * on entry; each new version logs the one it hides in undo, and leaving
+ * a block rolls the log back to where it was on entry.
+ */
+void Function::ssa_rename()
 {
-    Operand r;
-    r.type = Operand::REG;
-    r.reg = in;
-    r.ssa_idx = -1;
-    return r;
-}
+    int nv = localvars.size();
+    vector<int> top(nv, 0), count(nv, 0);
+    vector<pair<int, int> > undo;
+    auto push = [&](Localvar* var) {
+        int v = var->id;
+        undo.push_back(make_pair(v, top[v]));
+        return top[v] = ++count[v];
+    };
+
+    struct Frame {
+        Block* b;
+        std::list<Block*>::iterator next;
+        size_t mark;
+    };
+    vector<Frame> stack;
+    Block* b = entry;
+    for (;;) {
+        if (b != nullptr) {
+            stack.push_back(Frame{b, b->domc.begin(), undo.size()});
+
+            for (Phi& phi : b->phi)
+                phi.l = push(phi.var);
 
-void Block::ssa_rename_var(map<Localvar*, RenameStack>& stack)
-{
-    for (auto& var_phi : phi)
-        var_phi.second.l = stack[var_phi.first].push();
-
-    for (Instruction* in : instr) {
-        if (in->oper[0].is_local())
-            in->oper[0].ssa_idx = stack[in->oper[0].var].top();
-        if (in->oper[1].is_local())
-            in->oper[1].ssa_idx = stack[in->oper[1].var].top();
-
-        if (in->is_move() && in->oper[1].is_local())
-            in->oper[1].ssa_idx = stack[in->oper[1].var].push();
-    }
+            for (Instruction* in : b->instr) {
+                if (in->oper[0].is_local())
+                    in->oper[0].ssa_idx = top[in->oper[0].var->id];
+                if (in->oper[1].is_local())
+                    in->oper[1].ssa_idx = top[in->oper[1].var->id];
 
-    assert(seq_next == nullptr || seq_next != br_next);
-    rename_phi(seq_next, this, stack);
-    rename_phi(br_next, this, stack);
+                if (in->is_move() && in->oper[1].is_local())
+                    in->oper[1].ssa_idx = push(in->oper[1].var);
+            }
 
-    for (Block* c : domc)
-        c->ssa_rename_var(stack);
+            assert(b->seq_next == nullptr || b->seq_next != b->br_next);
+            rename_phi(b->seq_next, b, top);
+            rename_phi(b->br_next, b, top);
+        }
 
-    for (Localvar* var : defs)
-        stack[var].pop();
+        if (stack.empty()) break;
+        Frame& f = stack.back();
+        if (f.next != f.b->domc.end()) {
+            b = *f.next++;
+            continue;
+        }
+        for (; undo.size() > f.mark; undo.pop_back())
+            top[undo.back().first] = undo.back().second;
+        stack.pop_back();
+        b = nullptr;
+    }
+    ssa_versions.swap(count);
 }
 
-
 /*
 void Function::remove_phi()
 {
@@ -238,128 +381,174 @@ bool Operand::operator< (const Operand& o) const
     return ssa_idx < o.ssa_idx;
 }
 
-void Function::ssa_constant_propagate()
+/*
+ * Numbers the SSA values and collects their definitions and uses, all
+ * after a fresh index().  Version 0 of each variable, its value on
+ * entry, counts as defined in the entry block.
+ */
+void Function::ssa_index()
 {
-    map<Operand, long long> const_val;
-
-    bool updated = true;
-    while (updated) {
-        updated = false;
+    index();
+    int nv = localvars.size();
+    if ((int)ssa_versions.size() < nv)
+        ssa_versions.resize(nv, 0);
+    ssa_value_base.resize(nv);
+    int n = instrs.size();
+    for (int v = 0; v < nv; ++v) {
+        ssa_value_base[v] = n;
+        n += ssa_versions[v] + 1;
+    }
 
-        for (Block* b : blocks) {
-            for (auto& var_phi : b->phi) {
-                Localvar* var = var_phi.first;
-                Phi& phi = var_phi.second;
-                assert(!phi.r.empty());
+    value_block.assign(n, nullptr);
+    value_uses.assign(n, vector<Use>());
+    for (int v = 0; v < nv; ++v)
+        value_block[ssa_value_base[v]] = entry;
+    for (Block* b : blocks) {
+        for (size_t p = 0; p < b->phi.size(); ++p) {
+            Phi& phi = b->phi[p];
+            value_block[ssa_value_base[phi.var->id] + phi.l] = b;
+            for (size_t o = 0; o < phi.r.size(); ++o) {
+                int v = value_of(phi.r[o]);
+                if (v >= 0)
+                    value_uses[v].push_back(Use{b, nullptr, (int)p, (int)o});
+            }
+        }
+        for (Instruction* in : b->instr) {
+            if (in->op == Opcode::NOP) continue;
+            value_block[in->id] = b;
+            if (in->is_move() && in->oper[1].is_local())
+                value_block[value_of(in->oper[1])] = b;
+            for (int o = 0; o < 2; ++o) {
+                int v = in->isrightvalue(o) ? value_of(in->oper[o]) : -1;
+                if (v >= 0)
+                    value_uses[v].push_back(Use{b, in, -1, o});
+            }
+        }
+    }
+}
 
-                for (Operand& oper : phi.r)
-                    if (const_val.count(oper) > 0)
-                        oper.to_const(const_val[oper]);
+/* Uses by erased instructions and cleared phis are dropped on the way */
+void Function::replace_all_uses(int value, const Operand& with)
+{
+    int w = value_of(with);
+    for (const Use& u : value_uses[value]) {
+        if (u.in ? u.in->op == Opcode::NOP : u.block->phi[u.phi].r.empty()) continue;
+        use_operand(u) = with;
+        if (w >= 0)
+            value_uses[w].push_back(u);
+    }
+    value_uses[value].clear();
+}
 
-                if (phi.is_const()) {
-                    const_val[ssa_oper(var, phi.l)] = phi.value();
-                    phi.clear();
-                    updated = true;
-                }
-            }
+/*
+ * Folds constant instructions and phis whose operands are all the same
+ * constant, then puts the constant into every use of the value off its
+ * use list and looks at those users again.
+ */
+void Function::ssa_constant_propagate()
+{
+    ssa_index();
+
+    // Instructions, and phis with in NULL, to look at
+    vector<Use> work;
+    for (Block* b : blocks) {
+        for (size_t p = 0; p < b->phi.size(); ++p)
+            work.push_back(Use{b, nullptr, (int)p, -1});
+        for (Instruction* in : b->instr)
+            work.push_back(Use{b, in, -1, -1});
+    }
 
-            for (Instruction* in : b->instr)
-                if (in->op) {
-                    for (int i = 0; i < 2; ++i)
-                        if (in->isrightvalue(i) && const_val.count(in->oper[i]) > 0)
-                                in->oper[i].to_const(const_val[in->oper[i]]);
-
-                    if (in->isconst()) {
-                        long long val = in->constvalue();
-                        const_val[reg_oper(in)] = val;
-                        if (in->is_move())
-                            const_val[in->oper[1]] = val;
-                        in->erase();
-                        updated = true;
-                    }
-                }
+    Operand c;
+    auto fold = [&](int value) {
+        for (const Use& u : value_uses[value])
+            work.push_back(Use{u.block, u.in, u.phi, -1});
+        replace_all_uses(value, c);
+    };
+    for (size_t i = 0; i < work.size(); ++i) {
+        Use u = work[i];
+        if (u.in == nullptr) {
+            Phi& phi = u.block->phi[u.phi];
+            if (phi.empty() || !phi.is_const()) continue;
+            c.to_const(phi.value());
+            fold(ssa_value_base[phi.var->id] + phi.l);
+            phi.clear();
+        } else if (u.in->op != Opcode::NOP && u.in->isconst()) {
+            Instruction* in = u.in;
+            c.to_const(in->constvalue());
+            fold(in->id);
+            if (in->is_move() && in->oper[1].is_local())
+                fold(value_of(in->oper[1]));
+            in->erase();
         }
     }
 }
 
-void Phi::icode(FILE* out, Localvar* var) const
+void Phi::icode(Output& out, const Names& names) const
 {
     if (r.empty()) return;
-    fprintf(out, "instr %d: phi", name);
+    out << "instr " << name << ": phi";
     for (const Operand& oper : r) {
         if (oper.is_local()) {
-            fprintf(out, " %s$%d", oper.var->name.c_str(), oper.ssa_idx);
+            out << ' ' << names[oper.var->name] << '$' << oper.ssa_idx;
         } else {
             assert(oper.is_const());
-            fprintf(out, " %lld", oper.value_const);
+            out << ' ' << oper.value_const;
         }
     }
-    fprintf(out, "\ninstr %d: move (%d) %s$%d\n", name + 1, name, var->name.c_str(), l);
-}
-
-static inline map<Operand, Block*> calc_oper2block(Function* f)
-{
-    map<Operand, Block*> ret;
-    for (Block* b : f->blocks)
-        for (Instruction* in : b->instr) {
-            if (in->is_move())
-                ret[in->oper[1]] = b;
-            ret[reg_oper(in)] = b;
-        }
-    return ret;
-}
-
-static inline vector<Block*> calc_loop_order(Function* f)
-{
-    unordered_map<Block*, int> cnt;
-    for (auto& head_loop : f->loops)
-        for (Block* b : head_loop.second)
-            ++cnt[b];
-
-    multimap<int, Block*> order;
-    for (auto& block_cnt : cnt)
-        order.insert(make_pair(block_cnt.second, block_cnt.first));
-
-    vector<Block*> ret;
-    for (auto& cnt_block : order)
-        ret.push_back(cnt_block.second);
-    return ret;
+    out << "\ninstr " << name + 1 << ": move (" << name << ") " << names[var->name] << '$' << l << '\n';
 }
 
+/*
+ * Hoists each instruction to the preheader of the outermost enclosing
+ * reducible loop its operands are not defined in.  Loops are taken
+ * innermost first straight from the forest.  A loop without a canonical
+ * preheader gets a new one when something is hoisted to it.
+ */
 void Function::ssa_licm()
 {
-    map<Operand, Block*> oper2block = calc_oper2block(this);
-    vector<Block*> loop_order = calc_loop_order(this);
-
-    for (Block* b : loop_order) {
-        for (Instruction* in : b->instr) {
-            Block* b0 = nullptr;
-            if (in->isrightvalue(0) && (in->oper[0].type == Operand::LOCAL || in->oper[0].type == Operand::REG))
-                b0 = oper2block[in->oper[0]];
-            Block* b1 = nullptr;
-            if (in->isrightvalue(1) && (in->oper[1].type == Operand::LOCAL || in->oper[1].type == Operand::REG))
-                b1 = oper2block[in->oper[1]];
-
-            Block* last = nullptr;
-            for (Block *loop_header = b; loop_header != NULL; loop_header = loop_header->idom) {
-                for (; loop_header && loops.count(loop_header) == 0; loop_header = loop_header->idom) { }
-                if (loop_header == nullptr) break;
-                if (loops[loop_header].count(b0) > 0 || loops[loop_header].count(b1) > 0) break;
-                last = loop_header;
-            }
+    ssa_index();
+    auto def_block = [&](const Operand& o) {
+        int v = value_of(o);
+        return v < 0 ? nullptr : value_block[v];
+    };
+    vector<vector<Instruction*> > hoist(loops.size());
+
+    for (int l = 0; l < (int)loops.size(); ++l) {
+        for (int i = loops[l].begin; i < loops[l].end; ++i) {
+            Block* b = blocks[loop_blocks[i]];
+            if (loop_of[b->id] != l) continue;
+            for (Instruction*& in : b->instr) {
+                Block* b0 = in->isrightvalue(0) ? def_block(in->oper[0]) : nullptr;
+                Block* b1 = in->isrightvalue(1) ? def_block(in->oper[1]) : nullptr;
+
+                int last = -1;
+                for (int m = l; m != -1; m = loops[m].parent) {
+                    if ((b0 && in_loop(m, b0->id)) || (b1 && in_loop(m, b1->id))) break;
+                    if (!loops[m].irreducible) last = m;
+                }
 
-            if (last == nullptr) continue;
+                if (last == -1) continue;
 
-            last->insert.push_back(new Instruction(*in));
-            in->erase();
+                // The instruction itself moves, so REG operands naming it
+                // follow; a tombstone takes its place
+                hoist[last].push_back(in);
+                in = arena.make<Instruction>(*in);
+                in->erase();
+            }
         }
     }
 
-    for (auto b_loop : loops) {
-        Block* b = b_loop.first;
-        if (b->insert.empty()) continue;
+    vector<pair<Block*, int> > added;
+    for (int l = 0; l < (int)loops.size(); ++l) {
+        if (hoist[l].empty()) continue;
+        if (loops[l].preheader != -1) {
+            for (Instruction* in : hoist[l])
+                blocks[loops[l].preheader]->append(in);
+            continue;
+        }
 
-        Block* newb = new Block(this, b->insert.begin(), b->insert.end());
+        Block* b = blocks[loops[l].header];
+        Block* newb = arena.make<Block>(this, hoist[l].begin(), hoist[l].end());
 
         vector<Block*> old_prevs;
         old_prevs.swap(b->prevs);
@@ -369,11 +558,13 @@ void Function::ssa_licm()
         blocks.push_back(newb);
 
         for (Block* prev : old_prevs) {
-            if (loops[b].count(prev) > 0) {
+            if (in_loop(l, prev->id)) {
                 b->prevs.push_back(prev);
                 assert(prev->seq_next != b);
             } else {
                 newb->prevs.push_back(prev);
+                ssa_remove_edge(prev, b);
+                ssa_add_edge(prev, newb);
                 if (prev->seq_next == b) prev->seq_next = newb;
                 if (prev->br_next == b) {
                     prev->br_next = newb;
@@ -382,11 +573,27 @@ void Function::ssa_licm()
                 if (prev->order_next == b) prev->order_next = newb;
             }
         }
+        if (!newb->prevs.empty()) {
+            b->prevs.push_back(newb);
+            ssa_add_edge(newb, b);
+        }
+
+        dom_insert_preheader(newb, b);
+        added.push_back(make_pair(newb, loops[l].parent));
     }
+
+    index();
+    for (auto& b_loop : added)
+        loop_of.push_back(b_loop.second);
+    finish_loops();
+    number_domtree();
+    if (prog->verify)
+        dom_verify();
+    ssa_update();
 }
 
 /*
-void Program::ssa_icode(FILE* out)
+void Program::ssa_icode(Output& out)
 {
     ssa_mode = true;
     fputs("instr 1: nop\n", out);
@@ -395,7 +602,7 @@ void Program::ssa_icode(FILE* out)
 
     for (Function* func : funcs) {
         if (func->is_main)
-            fprintf(out, "instr %lld: entrypc\n", func->entry->addr() - 1);
+            out << "instr " << func->entry->addr() - 1 << ": entrypc\n";
 
         for (auto& addr_block : func->blocks) {
             auto& block = addr_block.second;
@@ -412,18 +619,18 @@ void Program::ssa_icode(FILE* out)
                 if (phi.r.empty()) continue;
                 string tag = func->offset2tag[var];
 
-                fprintf(out, "instr %lld: phi", phi_addr);
+                out << "instr " << phi_addr << ": phi";
                 for (const Operand& oper : phi.r) {
                     if (oper.type == Operand::LOCAL) {
-                        fprintf(out, " %s$%d", tag.c_str(), oper.ssa_idx);
+                        out << ' ' << tag << '$' << oper.ssa_idx;
                     } else {
                         assert(oper.type == Operand::CONST);
-                        fprintf(out, " %lld", oper.value);
+                        out << ' ' << oper.value;
                     }
                 }
                 fputc('\n', out);
 
-                fprintf(out, "instr %lld: move (%lld) %s$%d\n", phi_addr + 1, phi_addr, tag.c_str(), phi.l);
+                out << "instr " << phi_addr + 1 << ": move (" << phi_addr << ") " << tag << '$' << phi.l << '\n';
 
                 phi_addr += 2;
             }
@@ -435,17 +642,17 @@ void Program::ssa_icode(FILE* out)
             Instruction& in = block->instr.back();
             if (in.op == Opcode::NOP) continue;
             if (in.op == Opcode::BR)
-                fprintf(out, "instr %lld: br [%lld]\n", in.addr, block->br_next->ssa_addr);
+                out << "instr " << in.addr << ": br [" << block->br_next->ssa_addr << "]\n";
             else if (in.op == Opcode::BLBC)
-                fprintf(out, "instr %lld: blbc (%lld) [%lld]\n", in.addr, in.oper[0].value, block->br_next->ssa_addr);
+                out << "instr " << in.addr << ": blbc (" << in.oper[0].value << ") [" << block->br_next->ssa_addr << "]\n";
             else if (in.op == Opcode::BLBS)
-                fprintf(out, "instr %lld: blbs (%lld) [%lld]\n", in.addr, in.oper[0].value, block->br_next->ssa_addr);
+                out << "instr " << in.addr << ": blbs (" << in.oper[0].value << ") [" << block->br_next->ssa_addr << "]\n";
             else
                 in.icode(out);
         }
     }
 
-    fprintf(out, "instr %d: nop\n", (int)instr.size() - 1);
+    out << "instr " << (int)instr.size() - 1 << ": nop\n";
 }
 
 void Program::compute_df()
@@ -476,32 +683,24 @@ void Program::ssa_rename_var()
 
 void Program::ssa_licm()
 {
-    for (Function* func : funcs)
-        func->ssa_licm();
+    each_function(&Function::ssa_licm);
 }
 
-void Program::ssa_prepare()
+void Function::ssa_prepare()
 {
-    for (Function* f : funcs)
-        f->entry->compute_df();
-
-    for (Function* f : funcs)
-        for (Block* b : f->blocks)
-            b->find_defs();
-
-    for (Function* f : funcs)
-        f->place_phi();
+    compute_df();
+    place_phi();
+    ssa_rename();
+}
 
-    for (Function* f : funcs) {
-        map<Localvar*, RenameStack> stack;
-        f->entry->ssa_rename_var(stack);
-    }
+void Program::ssa_prepare()
+{
+    each_function(&Function::ssa_prepare);
 }
 
 void Program::ssa_constant_propagate()
 {
-    for (Function* f : funcs)
-        f->ssa_constant_propagate();
+    each_function(&Function::ssa_constant_propagate);
 }
 
 void Block::append(Instruction* in)
@@ -515,34 +714,137 @@ void Block::append(Instruction* in)
     }
 }
 
-void Program::ssa_to_3addr()
+/*
+ * Forwards the source of each copy into the uses of its target and
+ * drops the copy, then drops phis that only choose between one value
+ * and themselves.  Copies from registers stay: a register does not
+ * survive a call, so it cannot stand in for a variable.
+ */
+void Function::ssa_copy_propagate()
 {
-    for (Function* f : funcs)
-        for (Block* b : f->blocks)
-            for (auto& var_phi : b->phi) {
-                Localvar* var = var_phi.first;
-                Phi& phi = var_phi.second;
+    ssa_index();
+    int propagated = 0;
+    for (Block* b : blocks)
+        for (Instruction* in : b->instr) {
+            if (!in->is_move() || !in->oper[1].is_local()) continue;
+            Operand src = in->oper[0];
+            if (!src.is_const() && (!src.is_local() || src.ssa_idx < 0)) continue;
+            replace_all_uses(value_of(in->oper[1]), src);
+            in->erase();
+            ++propagated;
+        }
 
-                if (!phi.empty()) {
-                    for (int i = 0; i < phi.r.size(); ++i) {
-                        if (phi.r[i].is_const()) {
-                            Instruction* in = new Instruction();
-                            in->op.type = Opcode::MOVE;
-                            in->oper[0].type = Operand::CONST;
-                            in->oper[0].value_const = phi.r[i].value_const;
-                            in->oper[1].type = Operand::LOCAL;
-                            in->oper[1].var = var;
-                            phi.pre[i]->append(in);
-                        }
+    for (bool change = true; change; ) {
+        change = false;
+        for (Block* b : blocks)
+            for (Phi& phi : b->phi) {
+                if (phi.empty()) continue;
+                int self = ssa_value_base[phi.var->id] + phi.l;
+                const Operand* same = nullptr;
+                for (const Operand& o : phi.r) {
+                    if (value_of(o) == self || (same && !(*same < o) && !(o < *same))) continue;
+                    if (same) {
+                        same = nullptr;
+                        break;
                     }
-                    phi.clear();
+                    same = &o;
                 }
+                if (same == nullptr) continue;
+                Operand with = *same;
+                phi.clear();
+                replace_all_uses(self, with);
+                ++propagated;
+                change = true;
             }
+    }
 
-    for (Function* f : funcs)
-        for (Block* b : f->blocks)
-            for (Instruction* in : b->instr) {
-                in->oper[0].ssa_idx = -1;
-                in->oper[1].ssa_idx = -1;
+    if (prog->output_report) {
+        report(std_out, "Function: %d\n", name);
+        report(std_out, "Number of copies propagated: %d\n", propagated);
+    }
+}
+
+void Program::ssa_copy_propagate()
+{
+    each_function(&Function::ssa_copy_propagate);
+}
+
+/*
+ * Dead code elimination by mark and sweep over the use lists: what is
+ * not eliminable is live, and so is the definition of every value
+ * something live reads.  Versions of a variable overlap once copies
+ * are propagated, so liveness of the variable would not do.
+ */
+void Function::ssa_dead_eliminate()
+{
+    ssa_index();
+    int n = value_block.size(), ni = instrs.size();
+    // What defines each value, by the id it is marked under: an
+    // instruction's own, or the phi's value; -1 for version 0
+    vector<int> def(n, -1);
+    vector<Phi*> phi_of(n, nullptr);
+    for (int v = 0; v < ni; ++v)
+        def[v] = v;
+    for (Block* b : blocks) {
+        for (Phi& phi : b->phi)
+            if (!phi.empty()) {
+                int v = ssa_value_base[phi.var->id] + phi.l;
+                def[v] = v;
+                phi_of[v] = &phi;
+            }
+        for (Instruction* in : b->instr)
+            if (in->is_move() && in->oper[1].is_local() && in->oper[1].ssa_idx >= 0)
+                def[value_of(in->oper[1])] = in->id;
+    }
+
+    vector<char> live(n, 0);
+    vector<int> work;
+    auto mark = [&](const Operand& o) {
+        int v = value_of(o);
+        if (v >= 0 && def[v] >= 0 && !live[def[v]]) {
+            live[def[v]] = 1;
+            work.push_back(def[v]);
+        }
+    };
+    for (Instruction* in : instrs)
+        if (in->op != Opcode::NOP && !in->eliminable()) {
+            live[in->id] = 1;
+            work.push_back(in->id);
+        }
+    while (!work.empty()) {
+        int v = work.back();
+        work.pop_back();
+        if (v < ni) {
+            for (int o = 0; o < 2; ++o)
+                if (instrs[v]->isrightvalue(o))
+                    mark(instrs[v]->oper[o]);
+        } else
+            for (const Operand& o : phi_of[v]->r)
+                mark(o);
+    }
+
+    int elimin_count_in = 0, elimin_count_out = 0;
+    for (Block* b : blocks) {
+        for (Instruction* in : b->instr)
+            if (in->op != Opcode::NOP && !live[in->id]) {
+                in->erase();
+                if (loop_of[b->id] != -1)
+                    ++elimin_count_in;
+                else
+                    ++elimin_count_out;
             }
+        b->phi.erase(std::remove_if(b->phi.begin(), b->phi.end(), [&](const Phi& phi) {
+            return phi.empty() || !live[ssa_value_base[phi.var->id] + phi.l];
+        }), b->phi.end());
+    }
+    if (prog->output_report) {
+        report(std_err, "Function: %d\n", name);
+        report(std_err, "Number of statements eliminated in SCR: %d\n", elimin_count_in);
+        report(std_err, "Number of statements eliminated not in SCR: %d\n", elimin_count_out);
+    }
+}
+
+void Program::ssa_dead_eliminate()
+{
+    each_function(&Function::ssa_dead_eliminate);
 }
@@ -0,0 +1,358 @@
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "dataflow.h"
+#include "icode.h"
+
+using std::vector;
+using std::pair;
+using std::make_pair;
+
+/*
+ * Out of SSA after Boissinot, Darte, Rastello, de Dinechin and Guillon,
+ * "Revisiting Out-of-SSA Translation for Correctness, Code Quality and
+ * Efficiency".  Versions are coalesced where their live ranges do not
+ * meet: each phi with its operands, then every version with the others
+ * of its variable, or of another variable it was coalesced with.  That
+ * second step is all the old translation did, right only as long as no
+ * pass let versions overlap.  A version's range starts at its
+ * definition, a phi's at the top of its block, and a phi operand is
+ * read at the end of its predecessor.  What does not fit in its own
+ * variable gets a new one in the frame.  Version 0 is the value on
+ * entry and stays where it is.
+ *
+ * The copies an edge still needs happen at once, a parallel copy: they
+ * are put in an order where nothing is written before it is read, a
+ * cycle going through one spare variable.  They go at the end of the
+ * predecessor, or in a new block on the edge if it is critical, where
+ * no more is live than at the end of the predecessor.
+ */
+
+namespace {
+
+/* Liveness of the versions of locals, phi operands live out of their predecessor */
+struct ValueLiveness {
+    static const Dataflow::Direction direction = Dataflow::BACKWARD;
+    static const Dataflow::Meet meet = Dataflow::UNION;
+
+    size_t n;
+    vector<BitVector> gen, kill, phi_out;  // By block id
+    BitVector scratch;
+
+    size_t bits() const { return n; }
+    void boundary(int, BitVector&) {}
+    void transfer(int b, const BitVector& out, BitVector& in)
+    {
+        scratch = out;
+        scratch.union_with(phi_out[b]);
+        in.transfer(scratch, gen[b], kill[b]);
+    }
+};
+
+class OutOfSsa {
+public:
+    OutOfSsa(Function* f): f(f) {}
+    void run();
+
+private:
+    Function* f;
+    int base = 0, n = 0;         // Versions are values base..base+n, named by the offset here
+    vector<int> var_of;          // Variable id of each version
+    vector<int> pos;             // Position in its block, -1 for a phi, -2 on entry
+    vector<int> at;              // By instruction id, position in its block
+    vector<BitVector> live_out;  // By block id
+    vector<int> parent;          // Union-find over versions
+    vector<vector<int> > members;  // By representative
+    vector<int> pin;             // By representative, variable of the version 0 held, or -1
+    vector<Localvar*> home;      // By representative, once given
+    Localvar* spare = nullptr;
+
+    void liveness();
+    Block* block(int v) const { return f->value_block[base + v]; }
+    int find(int v);
+    bool live_after(int a, int b) const;
+    bool interfere(int a, int b) const;
+    bool unite(int a, int b);
+    void sequence(Block* p, vector<pair<Localvar*, Operand> >& copies);
+};
+
+void OutOfSsa::liveness()
+{
+    int nb = f->blocks.size();
+    ValueLiveness lv;
+    lv.n = n;
+    lv.gen.assign(nb, BitVector(n));
+    lv.kill.assign(nb, BitVector(n));
+    lv.phi_out.assign(nb, BitVector(n));
+    for (Block* b : f->blocks) {
+        BitVector& gen = lv.gen[b->id];
+        BitVector& kill = lv.kill[b->id];
+        for (Phi& phi : b->phi) {
+            if (phi.empty()) continue;
+            kill.set(f->ssa_value_base[phi.var->id] + phi.l - base);
+            for (size_t o = 0; o < phi.r.size(); ++o) {
+                int v = phi.r[o].is_local() ? f->value_of(phi.r[o]) : -1;
+                if (v >= 0)
+                    lv.phi_out[phi.pre[o]->id].set(v - base);
+            }
+        }
+        for (Instruction* in : b->instr) {
+            for (int o = 0; o < 2; ++o) {
+                int v = in->isrightvalue(o) && in->oper[o].is_local() ? f->value_of(in->oper[o]) : -1;
+                if (v >= 0 && !kill.test(v - base))
+                    gen.set(v - base);
+            }
+            if (in->is_move() && in->oper[1].is_local() && in->oper[1].ssa_idx >= 0)
+                kill.set(f->value_of(in->oper[1]) - base);
+        }
+    }
+    DataflowSolver<ValueLiveness> solver(f, lv);
+    solver.solve();
+    live_out.swap(solver.out);
+    for (int b = 0; b < nb; ++b)
+        live_out[b].union_with(lv.phi_out[b]);
+}
+
+int OutOfSsa::find(int v)
+{
+    while (parent[v] != v)
+        v = parent[v] = parent[parent[v]];
+    return v;
+}
+
+/* Whether a is read at or after the point b is defined, in b's block or past it */
+bool OutOfSsa::live_after(int a, int b) const
+{
+    Block* bb = block(b);
+    if (live_out[bb->id].test(a))
+        return true;
+    for (const Use& u : f->value_uses[base + a])
+        if (u.block == bb && u.in != nullptr && u.in->op != Opcode::NOP && at[u.in->id] > pos[b])
+            return true;
+    return false;
+}
+
+/*
+ * In strict SSA two ranges meet only if the earlier definition, which
+ * dominates the later one, is still live there.  Code out of reach of
+ * the entry never runs, so nothing there interferes.
+ */
+bool OutOfSsa::interfere(int a, int b) const
+{
+    Block *ba = block(a), *bb = block(b);
+    if (ba == nullptr || bb == nullptr || ba->dom_depth < 0 || bb->dom_depth < 0)
+        return false;
+    if (ba == bb) {
+        if (pos[a] == -1 && pos[b] == -1)
+            return true;  // Phis of one block are all written at once
+        return pos[a] <= pos[b] ? live_after(a, b) : live_after(b, a);
+    }
+    if (ba->dominates(bb))
+        return live_after(a, b);
+    if (bb->dominates(ba))
+        return live_after(b, a);
+    return false;
+}
+
+/* Puts the classes of a and b together unless their versions interfere */
+bool OutOfSsa::unite(int a, int b)
+{
+    a = find(a);
+    b = find(b);
+    if (a == b)
+        return true;
+    if (pin[a] != -1 && pin[b] != -1 && pin[a] != pin[b])
+        return false;
+    for (int x : members[a])
+        for (int y : members[b])
+            if (interfere(x, y))
+                return false;
+    if (members[a].size() < members[b].size())
+        std::swap(a, b);
+    parent[b] = a;
+    members[a].insert(members[a].end(), members[b].begin(), members[b].end());
+    vector<int>().swap(members[b]);
+    if (pin[a] == -1)
+        pin[a] = pin[b];
+    if (home[a] == nullptr)
+        home[a] = home[b];
+    return true;
+}
+
+/* Appends the parallel copies to p one at a time, no destination written before it is read */
+void OutOfSsa::sequence(Block* p, vector<pair<Localvar*, Operand> >& copies)
+{
+    auto emit = [&](Localvar* to, const Operand& from) {
+        Instruction* in = f->arena.make<Instruction>();
+        in->op.type = Opcode::MOVE;
+        in->oper[0] = from;
+        in->oper[1].type = Operand::LOCAL;
+        in->oper[1].var = to;
+        p->append(in);
+    };
+    while (!copies.empty()) {
+        bool progress = false;
+        for (size_t i = 0; i < copies.size(); ) {
+            Localvar* to = copies[i].first;
+            bool read = false;
+            for (size_t j = 0; j < copies.size(); ++j)
+                if (j != i && copies[j].second.is_local() && copies[j].second.var == to)
+                    read = true;
+            if (read) {
+                ++i;
+                continue;
+            }
+            emit(to, copies[i].second);
+            copies.erase(copies.begin() + i);
+            progress = true;
+        }
+        if (progress) continue;
+
+        // Only cycles are left: one destination goes to the spare first
+        Localvar* to = copies.front().first;
+        if (spare == nullptr)
+            spare = f->add_local(to->name);
+        Operand save;
+        save.type = Operand::LOCAL;
+        save.var = to;
+        emit(spare, save);
+        for (auto& c : copies)
+            if (c.second.is_local() && c.second.var == to)
+                c.second.var = spare;
+    }
+}
+
+void OutOfSsa::run()
+{
+    f->number_domtree();
+    f->ssa_index();
+    base = f->ssa_value_base.empty() ? 0 : f->ssa_value_base[0];
+    n = f->value_block.size() - base;
+    int nv = f->localvars.size();
+
+    var_of.assign(n, -1);
+    pos.assign(n, -2);
+    for (int v = 0; v < nv; ++v)
+        for (int k = 0; k <= f->ssa_versions[v]; ++k)
+            var_of[f->ssa_value_base[v] + k - base] = v;
+    at.assign(f->instrs.size(), 0);
+    for (Block* b : f->blocks) {
+        for (Phi& phi : b->phi)
+            if (!phi.empty())
+                pos[f->ssa_value_base[phi.var->id] + phi.l - base] = -1;
+        for (size_t i = 0; i < b->instr.size(); ++i) {
+            Instruction* in = b->instr[i];
+            at[in->id] = i;
+            if (in->is_move() && in->oper[1].is_local() && in->oper[1].ssa_idx >= 0)
+                pos[f->value_of(in->oper[1]) - base] = i;
+        }
+    }
+    liveness();
+
+    parent.resize(n);
+    members.resize(n);
+    pin.assign(n, -1);
+    home.assign(n, nullptr);
+    for (int v = 0; v < n; ++v) {
+        parent[v] = v;
+        members[v].assign(1, v);
+    }
+    for (int v = 0; v < nv; ++v) {
+        int v0 = f->ssa_value_base[v] - base;
+        pin[v0] = v;
+        home[v0] = f->localvars[v];
+    }
+
+    // Each phi with its operands, then each version with its variable
+    for (Block* b : f->blocks)
+        for (Phi& phi : b->phi) {
+            if (phi.empty()) continue;
+            int r = f->ssa_value_base[phi.var->id] + phi.l - base;
+            for (const Operand& o : phi.r)
+                if (o.is_local())
+                    unite(r, f->value_of(o) - base);
+        }
+    for (int v = 0; v < n; ++v) {
+        if (var_of[v] == -1 || home[find(v)] != nullptr) continue;
+        vector<int> vars;
+        for (int m : members[find(v)])
+            if (std::find(vars.begin(), vars.end(), var_of[m]) == vars.end())
+                vars.push_back(var_of[m]);
+        bool placed = false;
+        for (size_t i = 0; i < vars.size() && !placed; ++i)
+            placed = unite(f->ssa_value_base[vars[i]] - base, v);
+        if (!placed)
+            home[find(v)] = f->add_local(f->localvars[var_of[v]]->name);
+    }
+
+    auto storage = [&](Operand& o) {
+        if (!o.is_local() || o.ssa_idx < 0) return;
+        o.var = home[find(f->value_of(o) - base)];
+        o.ssa_idx = -1;
+    };
+    for (Block* b : f->blocks)
+        for (Instruction* in : b->instr) {
+            storage(in->oper[0]);
+            storage(in->oper[1]);
+            if (in->is_move() && in->oper[0].is_local() && in->oper[1].is_local() &&
+                    in->oper[0].var == in->oper[1].var)
+                in->erase();
+        }
+
+    // The copies left on each edge into a block, in a new block on the
+    // edge when it is critical
+    bool split = false;
+    for (size_t i = 0, nb = f->blocks.size(); i < nb; ++i) {
+        Block* b = f->blocks[i];
+        vector<pair<Block*, vector<pair<Localvar*, Operand> > > > edges;
+        for (Phi& phi : b->phi) {
+            if (phi.empty()) continue;
+            Localvar* to = home[find(f->ssa_value_base[phi.var->id] + phi.l - base)];
+            for (size_t o = 0; o < phi.r.size(); ++o) {
+                Operand from = phi.r[o];
+                storage(from);
+                if (from.is_local() && from.var == to) continue;
+                size_t e = 0;
+                while (e < edges.size() && edges[e].first != phi.pre[o])
+                    ++e;
+                if (e == edges.size())
+                    edges.push_back(make_pair(phi.pre[o], vector<pair<Localvar*, Operand> >()));
+                edges[e].second.push_back(make_pair(to, from));
+            }
+        }
+        b->phi.clear();
+        for (auto& e : edges) {
+            Block* p = e.first;
+            if (p->seq_next != nullptr && p->br_next != nullptr) {
+                p = f->split_edge(p, b);
+                split = true;
+            }
+            sequence(p, e.second);
+        }
+    }
+    if (split) {
+        f->index();
+        f->build_domtree();
+    }
+}
+
+}
+
+void Function::ssa_to_3addr()
+{
+    OutOfSsa(this).run();
+
+    for (Block* b : blocks)
+        for (Instruction* in : b->instr) {
+            in->oper[0].ssa_idx = -1;
+            in->oper[1].ssa_idx = -1;
+        }
+
+    index();
+}
+
+void Program::ssa_to_3addr()
+{
+    each_function(&Function::ssa_to_3addr);
+}
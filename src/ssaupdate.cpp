@@ -0,0 +1,392 @@
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "icode.h"
+
+using std::vector;
+using std::pair;
+using std::make_pair;
+
+/*
+ * Incremental SSA repair after the on-demand construction of Braun et
+ * al., "Simple and Efficient Construction of Static Single Assignment
+ * Form".  A pass that adds definitions or edges to SSA code reports
+ * them with ssa_add_def(), ssa_add_edge() and ssa_remove_edge(), then
+ * calls ssa_update() once, with index() and the dominator tree current.
+ *
+ * For each variable concerned only the blocks a new definition or edge
+ * reaches before another definition are looked at.  Their uses read the
+ * variable backwards through the predecessors, each join on the way
+ * getting a phi that goes again if its operands all agree.  Outside
+ * them the old SSA stands: a block's value on exit is what a phi on one
+ * of its out edges took from it, or else the nearest definition up the
+ * dominator tree.
+ */
+
+void Function::ssa_add_def(Block* b, Instruction* in)
+{
+    int v = in->oper[1].var->id;
+    if (ssa_versions.size() < localvars.size())
+        ssa_versions.resize(localvars.size(), 0);
+    in->oper[1].ssa_idx = ++ssa_versions[v];
+    ssa_new_defs.push_back(make_pair(b, in));
+}
+
+void Function::ssa_add_edge(Block* from, Block* to)
+{
+    ssa_new_edges.push_back(make_pair(from, to));
+}
+
+void Function::ssa_remove_edge(Block* from, Block* to)
+{
+    ssa_dead_edges.push_back(make_pair(from, to));
+}
+
+namespace {
+
+struct NewPhi {
+    int block;
+    bool dead;
+    Phi phi;
+};
+
+class SsaRepair {
+public:
+    SsaRepair(Function* f);
+    void run(Localvar* var, bool edges);
+
+private:
+    Function* f;
+    int nb;
+    vector<vector<pair<int, int> > > last_def;  // (var id, version) by block id
+    std::unordered_map<long long, Operand> known;  // Value on exit, by block and var
+    std::unordered_set<long long> new_edges;
+    std::unordered_set<Instruction*> new_defs;
+
+    // Per variable, valid where the stamp matches
+    Localvar* var = nullptr;
+    int stamp = 0;
+    vector<int> entry_at, exit_at, memo_at, use_at;  // entry_at, exit_at: may have changed
+    vector<Operand> memo;  // Value on entry
+    vector<int> touched;
+    std::deque<NewPhi> phis;
+    vector<int> queue;
+    std::unordered_map<int, Operand> repl;  // Trivial phis, by version
+
+    long long key(int b, int v) const { return (long long)b * f->localvars.size() + v; }
+    Operand at(int idx) const;
+    bool find_def(int b, int& idx) const;
+    Phi* old_phi(int b) const;
+    Operand old_value(int b, bool exit);
+    Operand read(int b, bool exit);
+    Operand resolve(Operand o);
+    void enter(int b);
+};
+
+SsaRepair::SsaRepair(Function* f): f(f), nb(f->blocks.size()), last_def(nb),
+    entry_at(nb, 0), exit_at(nb, 0), memo_at(nb, 0), use_at(nb, 0), memo(nb)
+{
+    for (Block* b : f->blocks) {
+        for (Instruction* in : b->instr) {
+            if (!in->is_move() || !in->oper[1].is_local()) continue;
+            int v = in->oper[1].var->id;
+            vector<pair<int, int> >& d = last_def[b->id];
+            auto it = std::find_if(d.begin(), d.end(), [v](const pair<int, int>& p) { return p.first == v; });
+            if (it == d.end())
+                d.push_back(make_pair(v, in->oper[1].ssa_idx));
+            else
+                it->second = in->oper[1].ssa_idx;
+        }
+        for (const Phi& phi : b->phi)
+            for (size_t i = 0; i < phi.r.size(); ++i)
+                known[key(phi.pre[i]->id, phi.var->id)] = phi.r[i];
+    }
+    for (auto& e : f->ssa_new_edges)
+        new_edges.insert((long long)e.first->id * nb + e.second->id);
+    for (auto& d : f->ssa_new_defs)
+        new_defs.insert(d.second);
+}
+
+Operand SsaRepair::at(int idx) const
+{
+    Operand r;
+    r.type = Operand::LOCAL;
+    r.var = var;
+    r.ssa_idx = idx;
+    return r;
+}
+
+bool SsaRepair::find_def(int b, int& idx) const
+{
+    for (const pair<int, int>& d : last_def[b])
+        if (d.first == var->id) {
+            idx = d.second;
+            return true;
+        }
+    return false;
+}
+
+Phi* SsaRepair::old_phi(int b) const
+{
+    for (Phi& phi : f->blocks[b]->phi)
+        if (phi.var == var)
+            return &phi;
+    return nullptr;
+}
+
+/* Where nothing new reaches, from the old SSA */
+Operand SsaRepair::old_value(int b, bool exit)
+{
+    if (exit) {
+        auto k = known.find(key(b, var->id));
+        if (k != known.end())
+            return k->second;
+    }
+    for (Block* x = f->blocks[b]->idom; x != nullptr; x = x->idom) {
+        int idx;
+        if (find_def(x->id, idx))
+            return at(idx);
+        auto k = known.find(key(x->id, var->id));
+        if (k != known.end())
+            return k->second;
+        if (Phi* phi = old_phi(x->id))
+            return at(phi->l);
+    }
+    return at(0);
+}
+
+/*
+ * The variable on entry to or exit from b.  Chains of single
+ * predecessors are followed in a loop; a join gets a phi whose operands
+ * are read later off the queue, which also breaks cycles.
+ */
+Operand SsaRepair::read(int b, bool exit)
+{
+    vector<int> chain;
+    Operand r;
+    for (;;) {
+        int idx;
+        if (exit && find_def(b, idx)) {
+            r = at(idx);
+            break;
+        }
+        if (Phi* phi = old_phi(b)) {
+            r = at(phi->l);
+            break;
+        }
+        if (entry_at[b] != stamp) {
+            r = old_value(b, exit);
+            break;
+        }
+        if (memo_at[b] == stamp) {
+            r = memo[b];
+            break;
+        }
+        Block* blk = f->blocks[b];
+        memo_at[b] = stamp;
+        if (blk->prevs.size() != 1) {
+            if (blk->prevs.empty()) {
+                r = at(0);
+            } else {
+                phis.push_back(NewPhi{b, false, Phi()});
+                Phi& phi = phis.back().phi;
+                phi.var = var;
+                phi.l = ++f->ssa_versions[var->id];
+                phi.init(blk->prevs);
+                queue.push_back(phis.size() - 1);
+                r = at(phi.l);
+            }
+            memo[b] = r;
+            break;
+        }
+        memo[b] = at(0);  // Only seen again round a cycle of unreachable blocks
+        chain.push_back(b);
+        b = blk->prevs[0]->id;
+        exit = true;
+    }
+    for (int c : chain)
+        memo[c] = r;
+    return r;
+}
+
+Operand SsaRepair::resolve(Operand o)
+{
+    while (o.is_local() && o.var == var) {
+        auto it = repl.find(o.ssa_idx);
+        if (it == repl.end()) break;
+        o = it->second;
+    }
+    return o;
+}
+
+static bool same_value(const Operand& a, const Operand& b)
+{
+    if (a.is_const() && b.is_const())
+        return a.value_const == b.value_const;
+    return a.is_local() && b.is_local() && a.var == b.var && a.ssa_idx == b.ssa_idx;
+}
+
+void SsaRepair::enter(int b)
+{
+    if (entry_at[b] == stamp) return;
+    entry_at[b] = stamp;
+    touched.push_back(b);
+}
+
+void SsaRepair::run(Localvar* v, bool edges)
+{
+    var = v;
+    ++stamp;
+    touched.clear();
+    phis.clear();
+    queue.clear();
+    repl.clear();
+
+    // Blocks whose value on entry or exit may have changed
+    vector<int> defs;
+    for (auto& d : f->ssa_new_defs)
+        if (d.second->oper[1].var == var) {
+            defs.push_back(d.first->id);
+            exit_at[d.first->id] = stamp;
+        }
+    for (int b : defs)
+        for (Block* s : { f->blocks[b]->seq_next, f->blocks[b]->br_next })
+            if (s != nullptr) enter(s->id);
+    if (edges)
+        for (auto& e : f->ssa_new_edges)
+            enter(e.second->id);
+    for (size_t i = 0; i < touched.size(); ++i) {
+        int b = touched[i], idx;
+        if (old_phi(b) != nullptr || find_def(b, idx)) continue;
+        exit_at[b] = stamp;
+        for (Block* s : { f->blocks[b]->seq_next, f->blocks[b]->br_next })
+            if (s != nullptr) enter(s->id);
+    }
+
+    // Uses to rewrite, with their values before trivial phis go
+    vector<pair<Operand*, Operand> > writes;
+    vector<int> blocks(touched);
+    blocks.insert(blocks.end(), defs.begin(), defs.end());
+    for (int b : blocks) {
+        if (use_at[b] == stamp) continue;
+        use_at[b] = stamp;
+        bool fix = entry_at[b] == stamp && old_phi(b) == nullptr;
+        Operand cur;
+        if (fix) cur = read(b, false);
+        for (Instruction* in : f->blocks[b]->instr) {
+            if (in->op == Opcode::NOP) continue;
+            for (int o = 0; o < 2; ++o)
+                if (fix && in->oper[o].is_local() && in->oper[o].var == var && !(o == 1 && in->is_move()))
+                    writes.push_back(make_pair(&in->oper[o], cur));
+            if (in->is_move() && in->oper[1].is_local() && in->oper[1].var == var) {
+                fix = new_defs.count(in) > 0;
+                cur = in->oper[1];
+            }
+        }
+    }
+    for (int b : touched)
+        if (Phi* phi = old_phi(b))
+            for (size_t i = 0; i < phi->r.size(); ++i) {
+                int p = phi->pre[i]->id;
+                if (exit_at[p] == stamp || new_edges.count((long long)p * nb + b))
+                    writes.push_back(make_pair(&phi->r[i], read(p, true)));
+            }
+
+    for (size_t q = 0; q < queue.size(); ++q) {
+        Phi& phi = phis[queue[q]].phi;
+        for (size_t i = 0; i < phi.r.size(); ++i)
+            phi.r[i] = read(phi.pre[i]->id, true);
+    }
+
+    // A phi whose operands are all one value, or itself, is that value
+    bool change;
+    do {
+        change = false;
+        for (NewPhi& np : phis) {
+            if (np.dead) continue;
+            Operand same;
+            bool have = false, trivial = true;
+            for (const Operand& r : np.phi.r) {
+                Operand o = resolve(r);
+                if (o.is_local() && o.var == var && o.ssa_idx == np.phi.l) continue;
+                if (!have) {
+                    same = o;
+                    have = true;
+                } else if (!same_value(o, same)) {
+                    trivial = false;
+                    break;
+                }
+            }
+            if (trivial) {
+                repl[np.phi.l] = have ? same : at(0);
+                np.dead = true;
+                change = true;
+            }
+        }
+    } while (change);
+
+    for (auto& w : writes)
+        *w.first = resolve(w.second);
+    for (NewPhi& np : phis) {
+        if (np.dead) continue;
+        for (Operand& r : np.phi.r)
+            r = resolve(r);
+        vector<Phi>& in = f->blocks[np.block]->phi;
+        auto pos = std::upper_bound(in.begin(), in.end(), np.phi,
+            [](const Phi& a, const Phi& b) { return VarLess()(a.var, b.var); });
+        in.insert(pos, np.phi);
+    }
+}
+
+}
+
+void Function::ssa_update()
+{
+    if (ssa_new_defs.empty() && ssa_new_edges.empty() && ssa_dead_edges.empty())
+        return;
+    if (ssa_versions.size() < localvars.size())
+        ssa_versions.resize(localvars.size(), 0);
+
+    // Values on removed edges are still read off their phis here.
+    // Removing edges alone only drops phi operands.
+    std::unique_ptr<SsaRepair> repair;
+    if (!ssa_new_defs.empty() || !ssa_new_edges.empty())
+        repair.reset(new SsaRepair(this));
+
+    for (auto& e : ssa_dead_edges)
+        for (Phi& phi : e.second->phi)
+            for (size_t i = 0; i < phi.pre.size(); ++i)
+                if (phi.pre[i] == e.first) {
+                    phi.r.erase(phi.r.begin() + i);
+                    phi.pre.erase(phi.pre.begin() + i);
+                    break;
+                }
+    for (auto& e : ssa_new_edges)
+        for (Phi& phi : e.second->phi) {
+            phi.r.push_back(Operand());
+            phi.pre.push_back(e.first);
+        }
+
+    // A new edge may bring any variable somewhere new
+    if (!ssa_new_edges.empty()) {
+        for (Localvar* var : localvars)
+            repair->run(var, true);
+    } else if (repair) {
+        vector<Localvar*> vars;
+        for (auto& d : ssa_new_defs)
+            vars.push_back(d.second->oper[1].var);
+        std::sort(vars.begin(), vars.end(), VarLess());
+        vars.erase(std::unique(vars.begin(), vars.end()), vars.end());
+        for (Localvar* var : vars)
+            repair->run(var, false);
+    }
+
+    ssa_new_defs.clear();
+    ssa_new_edges.clear();
+    ssa_dead_edges.clear();
+}